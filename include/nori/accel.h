@@ -20,6 +20,17 @@
 
 #include <nori/mesh.h>
 #include <nori/shape.h>
+#include <nori/cache.h>
+#include <atomic>
+
+/* Number of triangles intersected at once with packed leaves */
+#if defined(__AVX512F__)
+#  define NORI_TRIANGLE_SIMD_WIDTH 16
+#elif defined(__AVX__)
+#  define NORI_TRIANGLE_SIMD_WIDTH 8
+#else
+#  define NORI_TRIANGLE_SIMD_WIDTH 4
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,13 +49,61 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * The binary tree produced by the builder can optionally be collapsed into
+ * a wide BVH with 4 or 8 children per node (scene parameter \c bvhWidth).
+ * Wide nodes store the bounds of all children in SoA form, so that a single
+ * vectorized slab test covers every child, which are then visited in
+ * near-to-far order.
+ *
+ * To reduce the memory footprint of large meshes, wide nodes can also be
+ * stored in compressed form (scene parameter \c bvhCompression). Child
+ * bounds are then quantized to 8 or 16 bit integers relative to the
+ * bounds of the parent, rounding outwards so that the decoded boxes are
+ * conservative, and children are addressed relative to a per-node base.
+ *
+ * By default, leaves reference triangles by index, which requires looking
+ * up the mesh and gathering three vertices per intersection test. With the
+ * scene parameter \c bvhLeaves set to \c gathered, the triangles are
+ * instead copied into a leaf-ordered array in precomputed edge form.
+ * The \c packed mode goes one step further and stores the leaves as
+ * groups of \c NORI_TRIANGLE_SIMD_WIDTH triangles in SoA layout, which
+ * are intersected with a vectorized kernel (see \ref PackedTriangles).
+ * Leaves are padded to a multiple of the group size in this case, and the
+ * builder accounts for this in its cost model.
+ *
  * \author Wenzel Jakob
  */
 class Accel : public Shape{
     friend class BVHBuildTask;
 public:
-    /// Create a new and empty BVH
-    Accel() { m_meshOffset.push_back(0u); }
+    /**
+     * \brief Create a new and empty BVH
+     *
+     * The following parameters are recognized:
+     *
+     * \c bvhWidth: number of children per traversal node (2, 4 or 8).
+     *    A value of 2 traverses the binary tree produced by the builder
+     *    directly. Default: 4
+     *
+     * \c bvhCompression: quantize the child bounds of wide nodes to 8 or 16
+     *    bits (0 disables compression). Requires \c bvhWidth of 4 or 8.
+     *    Default: 0
+     *
+     * \c bvhLeaves: \c indexed to reference the mesh triangles from the
+     *    leaves, or \c gathered to store a copy of each triangle (one vertex,
+     *    two edges, mesh and triangle index) in leaf order. The latter
+     *    avoids all indirections during intersection tests, but needs
+     *    more memory. The mesh buffers are used for shading either way.
+     *    \c packed stores the triangles in SIMD groups (see above).
+     *    Default: \c indexed
+     *
+     * \c bvhBuilder: \c sweep evaluates every split position of small
+     *    subtrees (below 32 triangles) along all three axes, which requires
+     *    sorting the triangles. \c binned uses binned SAH on every level,
+     *    which builds faster at a small cost in tree quality.
+     *    Default: \c sweep
+     */
+    Accel(const PropertyList &props = PropertyList());
 
     /// Release all resources
     virtual ~Accel() { clear(); };
@@ -80,6 +139,31 @@ public:
     bool rayIntersect(Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const override;
 
+    /**
+     * \brief Intersect a packet of rays with the triangles stored in the BVH
+     *
+     * Coherent packets (all directions in the same octant) traverse the
+     * wide BVH together so that node visits and box tests are shared.
+     * Rays that end up alone in a subtree continue with single-ray
+     * traversal, and incoherent packets are traced ray by ray.
+     *
+     * \param rays
+     *    Array of \c count rays (at most \c NORI_PACKET_SIZE)
+     *
+     * \param its
+     *    Array of \c count intersection records. Only entries of rays that
+     *    hit something are written. Ignored (may be \c nullptr) for
+     *    shadow queries.
+     *
+     * \param shadowRay
+     *    \c true if only occlusion information is needed
+     *
+     * \return A bit mask with bit \c i set if ray \c i found an
+     *    intersection
+     */
+    uint64_t rayIntersectPacket(const Ray3f *rays, Intersection *its,
+        uint32_t count, bool shadowRay = false) const;
+
     /// Return the total number of meshes registered with the BVH
     uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
 
@@ -123,9 +207,76 @@ protected:
         return m_meshes[meshIdx]->getCentroid(index);
     }
 
+    /// Precompute the bounds and centroids of all triangles for the build
+    void prepareBuild();
+
+    /// Build the binary tree (\ref m_nodes and \ref m_indices)
+    void build();
+
+    /**
+     * \brief Convert the binary tree into the representation used for
+     * traversal (leaf padding, wide/quantized nodes, leaf storage)
+     */
+    void finalize();
+
+    /// Key of the BVH cache file: hash of all triangles and the build settings
+    uint64_t getCacheKey() const;
+
+    /// Load the binary tree from a cache file (see \ref CacheReader)
+    bool loadFromCache(const std::string &filename, uint64_t key);
+
+    /// Store the binary tree in a cache file (see \ref CacheWriter)
+    bool saveToCache(const std::string &filename, uint64_t key) const;
+
+    /// Report build progress after \c count triangles were placed in leaves
+    void reportProgress(uint32_t count);
+
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /**
+     * \brief Intersect a ray against the primitives of a leaf node
+     *
+     * Upon finding a closer intersection, \c ray.maxt is shortened and
+     * the hit is recorded in \c its, \c hitmesh and \c f (the latter two
+     * are needed by \ref finalizeIntersection()).
+     */
+    bool intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+        Intersection &its, bool shadowRay, const Mesh *&hitmesh,
+        uint32_t &f) const;
+
+    /// Compute the full intersection record after traversal found a hit
+    void finalizeIntersection(Intersection &its, const Mesh *hitmesh,
+        uint32_t f) const;
+
+    /// Traverse the binary BVH
+    bool traverseBinary(Ray3f &ray, Intersection &its, bool shadowRay,
+        const Mesh *&hitmesh, uint32_t &f) const;
+
+    /// Traverse the wide BVH with \c Width children per node
+    template <int Width> bool traverseWide(Ray3f &ray, Intersection &its,
+        bool shadowRay, const Mesh *&hitmesh, uint32_t &f,
+        uint32_t root = 0) const;
+
+    /**
+     * \brief Traverse the wide BVH with a coherent packet of rays
+     *
+     * \c rays must be already clipped (adaptive epsilon) and share the
+     * same direction octant. \c active marks the rays to be traced.
+     */
+    template <int Width> uint64_t traversePacket(Ray3f *rays, Intersection *its,
+        uint64_t active, bool shadowRay, const Mesh **hitmesh, uint32_t *f) const;
+
+    /// Traverse the quantized wide BVH
+    template <int Width, typename QType> bool traverseQuantized(Ray3f &ray,
+        Intersection &its, bool shadowRay, const Mesh *&hitmesh, uint32_t &f) const;
+
+    /// Convert the wide BVH into quantized nodes (reorders \c m_indices)
+    template <int Width, typename QType> void compress();
+
+    /// Collapse the binary BVH into a wide BVH with \c Width children per node
+    template <int Width> void collapse();
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -165,13 +316,122 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /// Nodes are stored in the BVH cache byte by byte
+    friend struct IsBitwiseCopyable<BVHNode>;
+
+    /**
+     * \brief Wide BVH node with \c Width children
+     *
+     * The child bounding boxes are stored in SoA form (all minimum
+     * X coordinates, then all minimum Y coordinates, etc.). Unused child
+     * slots have an empty bounding box that is never intersected.
+     */
+    template <int Width> struct WideBVHNode {
+        enum EBounds { EMinX = 0, EMinY, EMinZ, EMaxX, EMaxY, EMaxZ };
+
+        /// Child bounding boxes (see \ref EBounds)
+        float bounds[6][Width];
+        /// Index of an inner child node, or first index reference of a leaf
+        uint32_t child[Width];
+        /// Number of primitives for leaf children, zero for inner nodes
+        uint32_t size[Width];
+    };
+
+    /**
+     * \brief Quantized wide BVH node with \c Width children
+     *
+     * Child bounds are stored as integers relative to the parent bounds:
+     * <tt>origin + q * scale</tt> yields a conservative bound. Inner
+     * children are stored consecutively starting at \c childBase, and the
+     * index references of all leaf children consecutively starting at
+     * \c primBase (both in child slot order).
+     */
+    template <int Width, typename QType> struct QuantizedBVHNode {
+        enum EChildType : uint8_t { EEmpty = 0, EInner = 0xFF };
+        enum { MaxLeafSize = 0xFE };
+
+        /// Decoding parameters of each axis
+        float origin[3], scale[3];
+        /// Quantized child bounding boxes (see \ref WideBVHNode::EBounds)
+        QType qbounds[6][Width];
+        /// Index of the first inner child node
+        uint32_t childBase;
+        /// First index reference of the first leaf child
+        uint32_t primBase;
+        /// Number of primitives of leaf children, or \ref EChildType
+        uint8_t size[Width];
+    };
+
+    /// Leaf storage modes (scene parameter \c bvhLeaves)
+    enum ELeafStorage {
+        EIndexedLeaves = 0,
+        EGatheredLeaves,
+        EPackedLeaves
+    };
+
+    /// Number of triangles that leaf sizes are rounded to
+    uint32_t getLeafAlignment() const {
+        return m_leafStorage == EPackedLeaves ? NORI_TRIANGLE_SIMD_WIDTH : 1;
+    }
+
+    /// Pad all leaves to a multiple of \ref getLeafAlignment() triangles
+    void alignLeaves();
+
+    /// Index reference used to pad leaves
+    enum : uint32_t { PaddingIndex = 0xFFFFFFFFu };
+
+    /// Triangle copied into a leaf in precomputed edge form
+    struct LeafTriangle {
+        Point3f p0;             ///< First vertex
+        Vector3f edge1, edge2;  ///< Edges sharing the first vertex
+        uint32_t mesh;          ///< Index of the mesh (see \ref getMesh())
+        uint32_t index;         ///< Index of the triangle within the mesh
+    };
+
+    /// Return the wide node storage for the given width
+    template <int Width> std::vector<WideBVHNode<Width>> &wideNodes();
+    template <int Width> const std::vector<WideBVHNode<Width>> &wideNodes() const;
+
+    /// Return the quantized node storage for the given width and precision
+    template <int Width, typename QType>
+        std::vector<QuantizedBVHNode<Width, QType>> &quantizedNodes();
+    template <int Width, typename QType>
+        const std::vector<QuantizedBVHNode<Width, QType>> &quantizedNodes() const;
+
+    /// Is a quantized BVH present?
+    bool hasQuantizedNodes() const {
+        return !m_qnodes4_8.empty() || !m_qnodes4_16.empty() ||
+               !m_qnodes8_8.empty() || !m_qnodes8_16.empty();
+    }
 private:
     std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
     std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<float> m_primCentroid[3]; ///< Triangle centroids (SoA, only during the build)
+    std::vector<BoundingBox3f> m_primBounds; ///< Triangle bounds (only during the build)
+    std::atomic<uint32_t> m_buildProgress; ///< Triangles placed in leaves so far
+    std::atomic<int> m_progressReported; ///< Last reported progress (in percent)
+    bool m_binnedBuild;                 ///< Use binned SAH on every level?
+    std::vector<WideBVHNode<4>> m_nodes4; ///< 4-wide BVH nodes (if enabled)
+    std::vector<WideBVHNode<8>> m_nodes8; ///< 8-wide BVH nodes (if enabled)
+    std::vector<QuantizedBVHNode<4, uint8_t>> m_qnodes4_8;   ///< 4-wide 8-bit quantized nodes (if enabled)
+    std::vector<QuantizedBVHNode<4, uint16_t>> m_qnodes4_16; ///< 4-wide 16-bit quantized nodes (if enabled)
+    std::vector<QuantizedBVHNode<8, uint8_t>> m_qnodes8_8;   ///< 8-wide 8-bit quantized nodes (if enabled)
+    std::vector<QuantizedBVHNode<8, uint16_t>> m_qnodes8_16; ///< 8-wide 16-bit quantized nodes (if enabled)
+    std::vector<LeafTriangle> m_triangles; ///< Leaf-ordered triangles (if enabled)
+    std::vector<PackedTriangles<NORI_TRIANGLE_SIMD_WIDTH>> m_packed; ///< Packed leaf triangles (if enabled)
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+    int m_width;                        ///< Number of children per traversal node
+    int m_quantization;                 ///< Bits per quantized bound (0: uncompressed)
+    ELeafStorage m_leafStorage;         ///< How leaves reference their triangles
 };
 
+/* BVH nodes only consist of integers and a bounding box */
+template <> struct IsBitwiseCopyable<Accel::BVHNode>
+    : std::integral_constant<bool, IsBitwiseCopyable<BoundingBox3f>::value &&
+        sizeof(Accel::BVHNode) == sizeof(uint64_t) + sizeof(BoundingBox3f)> { };
+
 NORI_NAMESPACE_END
 
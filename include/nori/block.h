@@ -25,8 +25,12 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <tbb/spin_mutex.h>
+#include <atomic>
+#include <memory>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define NORI_RENDER_BATCH_SIZE 4096 /* Max. number of camera rays per Integrator::LiBatch() call */
 
 NORI_NAMESPACE_BEGIN
 
@@ -85,20 +89,64 @@ public:
     /// Convert a bitmap into an image block
     void fromBitmap(const Bitmap &bitmap);
 
+    /**
+     * \brief Save the unnormalized contents, including the filter weights
+     * and the border region, as a partial OpenEXR file
+     *
+     * The file has R, G, B and W (weight) channels. Its data window places
+     * the block (clipped to the image) within a display window of size
+     * \c imageSize. Partial files of disjoint crop windows can be combined
+     * using \ref putEXR(), which accounts for their overlapping borders.
+     * The extension ".exr" is appended to \c filename.
+     */
+    void saveEXR(const std::string &filename, const Vector2i &imageSize) const;
+
+    /// Add the contents of a partial OpenEXR file written by \ref saveEXR()
+    void putEXR(const std::string &filename);
+
     /// Clear all contents
     void clear() { setConstant(Color4f()); }
 
-    /// Record a sample with the given position and radiance value
+    /**
+     * \brief Record a sample with the given position and radiance value
+     *
+     * Filters covering at most 5x5 pixels use a specialized version with
+     * a fixed window size. The box filter adds the sample to the pixel
+     * containing it, so that every sample updates exactly one pixel.
+     */
     void put(const Point2f &pos, const Color3f &value);
 
     /**
      * \brief Merge another image block into this one
      *
      * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * the destination block using a mutex. With row locking (see
+     * \ref setRowLocking()), only the rows being modified are locked.
      */
     void put(ImageBlock &b);
 
+    /**
+     * \brief Use one lock per row instead of locking the whole block in
+     * \ref put(ImageBlock &)
+     *
+     * This is meant for the full-resolution image that many threads merge
+     * their blocks into. It assumes that the merged blocks don't overlap
+     * (apart from their borders) and use the same reconstruction filter:
+     * pixels that no other block can touch are then added without any
+     * locking, and only the border rows and columns are added while
+     * holding the lock of their row.
+     */
+    void setRowLocking(bool enabled);
+
+    /**
+     * \brief Copy the pixels without the border region into \c target
+     *
+     * The rows are copied one at a time, so that concurrent merges are
+     * only held up briefly. This is used by the GUI to upload a snapshot
+     * of the partially rendered image.
+     */
+    void snapshot(Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> &target) const;
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -108,6 +156,15 @@ public:
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /// Add a sample (in block coordinates) to the pixel containing it (box filter)
+    void putSingle(const Point2f &pos, const Color3f &value);
+
+    /// Splat a sample (in block coordinates) into an N x N pixel window
+    template <int N> void putFixed(const Point2f &pos, const Color3f &value);
+
+    /// Splat a sample (in block coordinates) for any filter size
+    void putGeneric(const Point2f &pos, const Color3f &value);
+
     Point2i m_offset;
     Vector2i m_size;
     int m_borderSize = 0;
@@ -116,7 +173,10 @@ protected:
     float *m_weightsX = nullptr;
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
+    int m_filterSize = 0; ///< Maximal number of pixels covered per axis
+    bool m_boxFilter = false; ///< Constant filter covering a single pixel?
     mutable tbb::mutex m_mutex;
+    mutable std::unique_ptr<tbb::spin_mutex[]> m_rowLocks;
 };
 
 /**
@@ -126,6 +186,12 @@ protected:
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
  * rendered first.
+ *
+ * The complete order is computed up front, and blocks are handed out
+ * through an atomic counter, so that worker threads never wait for each
+ * other. The last blocks of the spiral can optionally be split into
+ * quarters: this way, threads finishing early still find work while the
+ * others complete their final blocks.
  */
 class BlockGenerator {
 public:
@@ -135,32 +201,43 @@ public:
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param splitCount
+     *      Number of blocks at the end of the spiral that are
+     *      split into four smaller blocks (e.g. the thread count)
+     * \param offset
+     *      Position of the region within the image (for crop windows)
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
-    
+    BlockGenerator(const Vector2i &size, int blockSize, int splitCount = 0,
+                   const Point2i &offset = Point2i(0, 0));
+
     /**
      * \brief Return the next block to be rendered
      *
-     * This function is thread-safe
+     * This function is thread-safe and lock-free
      *
      * \return \c false if there were no more blocks
      */
     bool next(ImageBlock &block);
 
+    /// Configure \c block to cover the block with the given index
+    void getBlock(int index, ImageBlock &block) const;
+
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Start handing out the blocks from the beginning again
+    void reset() { m_next = 0; }
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
-    Vector2i m_numBlocks;
-    Vector2i m_size;
-    int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    /// Offset and size of a block
+    struct Block {
+        Point2i offset;
+        Vector2i size;
+    };
+
+    std::vector<Block> m_blocks;
+    std::atomic<int> m_next;
 };
 
 NORI_NAMESPACE_END
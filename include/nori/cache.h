@@ -0,0 +1,183 @@
+#pragma once
+
+#include <nori/bbox.h>
+#include <nori/color.h>
+#include <type_traits>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Can values of type \c T be stored in a cache file byte by byte?
+ *
+ * This holds for all trivially copyable types. The fixed-size Eigen-based
+ * types have user-provided copy operations and thus aren't trivially
+ * copyable, but they only consist of their coefficients. The specializations
+ * below mark them as safe after checking that their size matches.
+ */
+template <typename T> struct IsBitwiseCopyable : std::is_trivially_copyable<T> { };
+
+template <typename Scalar, int Dimension> struct IsBitwiseCopyable<TVector<Scalar, Dimension>>
+    : std::integral_constant<bool, std::is_trivially_copyable<Scalar>::value &&
+        sizeof(TVector<Scalar, Dimension>) == sizeof(Scalar) * Dimension> { };
+
+template <typename Scalar, int Dimension> struct IsBitwiseCopyable<TPoint<Scalar, Dimension>>
+    : std::integral_constant<bool, std::is_trivially_copyable<Scalar>::value &&
+        sizeof(TPoint<Scalar, Dimension>) == sizeof(Scalar) * Dimension> { };
+
+template <typename Point> struct IsBitwiseCopyable<TBoundingBox<Point>>
+    : std::integral_constant<bool, IsBitwiseCopyable<Point>::value &&
+        sizeof(TBoundingBox<Point>) == 2 * sizeof(Point)> { };
+
+template <> struct IsBitwiseCopyable<Color3f>
+    : std::integral_constant<bool, sizeof(Color3f) == 3 * sizeof(float)> { };
+
+template <> struct IsBitwiseCopyable<Color4f>
+    : std::integral_constant<bool, sizeof(Color4f) == 4 * sizeof(float)> { };
+
+/**
+ * \brief Set the directory of the binary scene cache
+ *
+ * When set (e.g. with the <tt>--cache</tt> command line option), meshes
+ * and BVHs are stored in binary form after they were first loaded/built
+ * and reused by subsequent runs. An empty path disables the cache. The
+ * directory is created if necessary.
+ */
+extern void setCacheDirectory(const std::string &path);
+
+/// Return the directory of the binary scene cache (empty if disabled)
+extern const std::string &getCacheDirectory();
+
+/// Return the path of the cache file with the given prefix and key
+extern std::string getCacheFilename(const std::string &prefix, uint64_t key);
+
+/// 64-bit FNV-1a hash of a memory region (\c seed continues a previous hash)
+extern uint64_t hashBytes(const void *data, size_t size,
+                          uint64_t seed = 0xcbf29ce484222325ull);
+
+/// Read-only memory mapping of an entire file
+class MappedFile {
+public:
+    /// Map the given file into memory (throws a \ref NoriException on failure)
+    MappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MappedFile();
+
+    /// Return a pointer to the file contents
+    const uint8_t *data() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Writes a binary cache file
+ *
+ * A cache file consists of a header (magic number, format version and
+ * a key that identifies its source data) followed by a sequence of
+ * arrays, each prefixed by its size in bytes. The file is first written
+ * under a temporary name and renamed by \ref commit(), so that other
+ * processes never see partially written files.
+ */
+class CacheWriter {
+public:
+    CacheWriter(const std::string &filename, uint64_t key);
+
+    /// Remove the temporary file unless \ref commit() was called
+    ~CacheWriter();
+
+    /// Append an array of \c size bytes
+    void write(const void *data, size_t size);
+
+    /// Append the contents of a vector
+    template <typename T> void write(const std::vector<T> &vec) {
+        static_assert(IsBitwiseCopyable<T>::value, "CacheWriter: type can't be stored byte by byte!");
+        write(vec.data(), sizeof(T) * vec.size());
+    }
+
+    /// Append the contents and dimensions of an Eigen matrix
+    template <typename Matrix> void writeMatrix(const Matrix &m) {
+        static_assert(IsBitwiseCopyable<typename Matrix::Scalar>::value,
+                      "CacheWriter: type can't be stored byte by byte!");
+        uint64_t dims[2] = { (uint64_t) m.rows(), (uint64_t) m.cols() };
+        write(dims, sizeof(dims));
+        write(m.data(), sizeof(typename Matrix::Scalar) * m.size());
+    }
+
+    /// Finish the file. Returns \c false if it couldn't be written
+    bool commit();
+
+private:
+    std::string m_filename;
+    FILE *m_file;
+    bool m_failed = false;
+};
+
+/**
+ * \brief Reads a binary cache file written by \ref CacheWriter
+ *
+ * The file is memory-mapped; arrays are copied straight from the
+ * mapping into their destination without any parsing.
+ */
+class CacheReader {
+public:
+    /**
+     * Open the given cache file. \ref isValid() reports whether it
+     * exists and was created from the source data identified by \c key.
+     */
+    CacheReader(const std::string &filename, uint64_t key);
+
+    ~CacheReader();
+
+    /// Can the file be used?
+    bool isValid() const { return m_file != nullptr; }
+
+    /// Return the next array and its size in bytes (throws if there is none)
+    const uint8_t *read(size_t &size);
+
+    /// Read the next array into a vector
+    template <typename T> void read(std::vector<T> &vec) {
+        static_assert(IsBitwiseCopyable<T>::value, "CacheReader: type can't be restored byte by byte!");
+        size_t size;
+        const uint8_t *data = read(size);
+        if (size % sizeof(T) != 0)
+            throw NoriException("CacheReader: array has an unexpected size!");
+        vec.resize(size / sizeof(T));
+        if (size > 0)
+            memcpy(static_cast<void *>(vec.data()), data, size);
+    }
+
+    /// Read the next array into an Eigen matrix
+    template <typename Matrix> void readMatrix(Matrix &m) {
+        static_assert(IsBitwiseCopyable<typename Matrix::Scalar>::value,
+                      "CacheReader: type can't be restored byte by byte!");
+        size_t size;
+        const uint64_t *dims = (const uint64_t *) read(size);
+        if (size != 2 * sizeof(uint64_t))
+            throw NoriException("CacheReader: expected matrix dimensions!");
+        m.resize((typename Matrix::Index) dims[0], (typename Matrix::Index) dims[1]);
+        const uint8_t *data = read(size);
+        if (size != sizeof(typename Matrix::Scalar) * m.size())
+            throw NoriException("CacheReader: matrix has an unexpected size!");
+        if (size > 0)
+            memcpy(static_cast<void *>(m.data()), data, size);
+    }
+
+private:
+    MappedFile *m_file = nullptr;
+    size_t m_pos = 0;
+};
+
+NORI_NAMESPACE_END
@@ -60,6 +60,12 @@ public:
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
+    /// Return the offset of the region that should be rendered (crop window)
+    const Point2i &getCropOffset() const { return m_cropOffset; }
+
+    /// Return the size of the region that should be rendered (crop window)
+    const Vector2i &getCropSize() const { return m_cropSize; }
+
     /// Return the camera's reconstruction filter in image space
     const ReconstructionFilter *getReconstructionFilter() const { return m_rfilter; }
 
@@ -70,6 +76,8 @@ public:
     EClassType getClassType() const { return ECamera; }
 protected:
     Vector2i m_outputSize;
+    Point2i m_cropOffset;
+    Vector2i m_cropSize;
     ReconstructionFilter *m_rfilter;
 };
 
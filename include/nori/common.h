@@ -49,6 +49,9 @@
 /* "Ray epsilon": relative error threshold for ray intersection computations */
 #define Epsilon 1e-4f
 
+/* Maximum number of rays in a packet query (see \ref Scene::rayIntersect) */
+#define NORI_PACKET_SIZE 64
+
 /* A few useful constants */
 #undef M_PI
 
@@ -142,6 +145,7 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+typedef Eigen::Matrix<uint16_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu16;
 
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
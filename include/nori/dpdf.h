@@ -19,6 +19,7 @@
 #pragma once
 
 #include <nori/common.h>
+#include <cmath>
 
 NORI_NAMESPACE_BEGIN
 
@@ -27,6 +28,12 @@ NORI_NAMESPACE_BEGIN
  * 
  * This data structure can be used to transform uniformly distributed
  * samples to a stored discrete probability distribution.
+ *
+ * Two sampling methods are provided: \ref sample() inverts the cumulative
+ * distribution with a binary search, which preserves the stratification
+ * of the input samples. \ref sampleAlias() uses Walker's alias method,
+ * which needs constant time (and a single random memory access)
+ * regardless of the number of entries.
  * 
  * \ingroup libcore
  */
@@ -42,6 +49,7 @@ public:
     void clear() {
         m_cdf.clear();
         m_cdf.push_back(0.0f);
+        m_alias.clear();
         m_normalized = false;
     }
 
@@ -91,6 +99,8 @@ public:
     /**
      * \brief Normalize the distribution
      *
+     * This also builds the table used by \ref sampleAlias().
+     *
      * \return Sum of the (previously unnormalized) entries
      */
     float normalize() {
@@ -101,6 +111,7 @@ public:
                 m_cdf[i] *= m_normalization;
             m_cdf[m_cdf.size()-1] = 1.0f;
             m_normalized = true;
+            buildAliasTable();
         } else {
             m_normalization = 0.0f;
         }
@@ -174,6 +185,86 @@ public:
         return index;
     }
 
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored
+     * distribution using the alias method
+     *
+     * This assumes that \ref normalize() has previously been called.
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleAlias(float sampleValue) const {
+        float unused = sampleValue;
+        return sampleAliasReuse(unused);
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored
+     * distribution using the alias method
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleAlias(float sampleValue, float &pdf) const {
+        size_t index = sampleAlias(sampleValue);
+        pdf = operator[](index);
+        return index;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored
+     * distribution using the alias method
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in,out] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleAliasReuse(float &sampleValue) const {
+        /* The integer part of the scaled sample chooses a column of the
+           table, the fractional part between the entry and its alias */
+        double scaled = (double) sampleValue * m_alias.size();
+        size_t column = std::min((size_t) scaled, m_alias.size() - 1);
+        double u = std::min(scaled - (double) column, std::nextafter(1.0, 0.0));
+
+        const AliasEntry &entry = m_alias[column];
+        if (u < entry.prob) {
+            sampleValue = (float) (u / entry.prob);
+            return column;
+        } else {
+            sampleValue = (float) ((u - entry.prob) / (1.0 - entry.prob));
+            return entry.alias;
+        }
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored
+     * distribution using the alias method
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in,out] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleAliasReuse(float &sampleValue, float &pdf) const {
+        size_t index = sampleAliasReuse(sampleValue);
+        pdf = operator[](index);
+        return index;
+    }
+
     /**
      * \brief Turn the underlying distribution into a
      * human-readable string format
@@ -190,7 +281,56 @@ public:
         return result + "}]";
     }
 private:
+    /// Build the alias table from the normalized entries (Vose's method)
+    void buildAliasTable() {
+        size_t n = size();
+        m_alias.resize(n);
+
+        /* Split the entries into those below and above the average */
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        uint32_t largest = 0;
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = ((double) m_cdf[i + 1] - (double) m_cdf[i]) * n;
+            if (scaled[i] > scaled[largest])
+                largest = (uint32_t) i;
+            if (scaled[i] < 1.0)
+                small.push_back((uint32_t) i);
+            else
+                large.push_back((uint32_t) i);
+        }
+
+        /* Fill up each small entry with the probability of a large one */
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            m_alias[s].prob = (float) scaled[s];
+            m_alias[s].alias = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        /* The remaining entries are (up to roundoff) exactly average.
+           Entries without any probability must never be chosen */
+        for (uint32_t i : large)
+            m_alias[i] = AliasEntry { 1.0f, i };
+        for (uint32_t i : small)
+            m_alias[i] = scaled[i] > 0.0 ? AliasEntry { 1.0f, i }
+                                         : AliasEntry { 0.0f, largest };
+    }
+
+    /// Column of the alias table
+    struct AliasEntry {
+        float prob;      ///< Probability of choosing the entry itself
+        uint32_t alias;  ///< Entry chosen otherwise
+    };
+
     std::vector<float> m_cdf;
+    std::vector<AliasEntry> m_alias;
     float m_sum, m_normalization;
     bool m_normalized;
 };
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <nori/object.h>
+#include <nori/bbox.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -28,6 +29,7 @@ struct EmitterQueryRecord {
     Normal3f n;    // normal at y
     Vector3f wi;   // direction x -> y
     float dist;    // |x - y|
+    uint32_t primIndex = (uint32_t) -1; // triangle of the mesh containing y (if known)
 };
 
 /**
@@ -48,6 +50,31 @@ public:
                             float &pdf) const = 0;
 
     virtual float pdf(const EmitterQueryRecord &lRec) const = 0;
+
+    /**
+     * \brief Return the total power emitted by this emitter
+     *
+     * The scene chooses emitters for next event estimation
+     * proportionally to the luminance of this value.
+     */
+    virtual Color3f getPower() const = 0;
+
+    /// Return a bounding box of the emitting surface
+    virtual BoundingBox3f getBoundingBox() const = 0;
+
+    /**
+     * \brief Return a cone that contains all directions of emission
+     *
+     * \param axis
+     *    The axis of the cone
+     * \return
+     *    The cosine of the half-angle of the cone
+     *    (-1 if the emitter radiates into all directions)
+     */
+    virtual float getEmissionCone(Vector3f &axis) const {
+        axis = Vector3f(0.0f, 0.0f, 1.0f);
+        return -1.0f;
+    }
 };
 
 NORI_NAMESPACE_END
@@ -18,7 +18,7 @@
 
 #pragma once
 
-#include <nori/common.h>
+#include <nori/block.h>
 #include <nanogui/screen.h>
 
 NORI_NAMESPACE_BEGIN
@@ -31,6 +31,7 @@ public:
     void drawContents();
 private:
     const ImageBlock &m_block;
+    Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_snapshot;
     nanogui::GLShader *m_shader = nullptr;
     nanogui::Slider *m_slider = nullptr;
     uint32_t m_texture = 0;
@@ -53,6 +53,32 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a batch of rays
+     *
+     * The renderer hands all camera rays of an image block (or a large
+     * portion of them) to this function at once. The default
+     * implementation simply calls \ref Li() for each ray; integrators
+     * that process many paths in lockstep can override it. Only those
+     * benefit from the packet queries of \ref Scene: \ref Li() traces
+     * its camera ray itself, and a single path has at most one shadow
+     * ray in flight.
+     *
+     * \param scene
+     *    A pointer to the underlying scene
+     * \param sampler
+     *    A pointer to a sample generator
+     * \param rays
+     *    Array of \c count rays
+     * \param result
+     *    Array of \c count radiance estimates, one for each ray
+     */
+    virtual void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                         Color3f *result, uint32_t count) const {
+        for (uint32_t i = 0; i < count; ++i)
+            result[i] = Li(scene, sampler, rays[i]);
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <nori/emitter.h>
+#include <nori/bbox.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Light hierarchy for choosing among many emitters
+ *
+ * A binary tree over the emitters of a scene, where every node stores the
+ * bounds, the total power and a cone around the emission directions of its
+ * subtree. Choosing an emitter for a shading point walks down the tree and
+ * picks each child with a probability proportional to a conservative
+ * estimate of its contribution at that point. Lights that are far away or
+ * facing away from the point thus rarely (or never) receive shadow rays.
+ */
+class LightBVH {
+public:
+    /**
+     * \brief Build the hierarchy over the given emitters
+     *
+     * \param emitters
+     *    The emitters, which must be attached to activated shapes
+     * \param power
+     *    The (luminance of the) power of each emitter
+     */
+    void build(const std::vector<const Emitter *> &emitters,
+               const std::vector<float> &power);
+
+    /// Release all memory
+    void clear();
+
+    /**
+     * \brief Choose an emitter for the shading point \c ref
+     *
+     * \param ref
+     *    The shading point
+     * \param sample
+     *    A uniformly distributed sample on [0,1]
+     * \param pdf
+     *    Probability of choosing the returned emitter
+     * \return
+     *    The index of the chosen emitter in the array passed to \ref build(),
+     *    or -1 if no emitter can illuminate \c ref
+     */
+    int sample(const Point3f &ref, float sample, float &pdf) const;
+
+    /// Return the probability of \ref sample() choosing emitter \c index for \c ref
+    float pdf(const Point3f &ref, uint32_t index) const;
+
+    /// Return a brief string summary of the structure
+    std::string toString() const;
+
+protected:
+    /// Binary tree node (inner nodes store their children next to each other)
+    struct Node {
+        BoundingBox3f bbox;
+        Vector3f axis;    ///< Axis of the emission cone
+        float cosTheta;   ///< Cosine of the half-angle of the emission cone
+        float power;      ///< Total power of the subtree
+        uint32_t index;   ///< Emitter (leaves) or left child (inner nodes)
+        bool leaf;
+    };
+
+    /// Maximum depth of the tree (the path to each leaf is stored as a 64-bit mask)
+    enum { MaxDepth = 64 };
+
+    /// Recursively build the subtree over the emitters <tt>[start, end)</tt> of \c lights
+    void buildRecursive(std::vector<Node> &lights, uint32_t nodeIdx, uint32_t start,
+                        uint32_t end, uint32_t depth, uint64_t path);
+
+    /// Estimate the contribution of a subtree to the point \c ref
+    static float importance(const Node &node, const Point3f &ref);
+
+private:
+    std::vector<Node> m_nodes;     ///< Tree nodes (root at index 0)
+    std::vector<uint64_t> m_path;  ///< Child choices from the root to each emitter
+    std::vector<uint8_t> m_depth;  ///< Depth of the leaf of each emitter
+};
+
+NORI_NAMESPACE_END
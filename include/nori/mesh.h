@@ -22,9 +22,79 @@
 #include <nori/frame.h>
 #include <nori/bbox.h>
 #include <nori/dpdf.h>
+#include <half.h>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Group of \c Width triangles in SoA layout (one vertex and the two
+ * edges sharing it, per coordinate), which are intersected together
+ *
+ * Eigen maps the fixed-size arrays below to SSE, AVX or AVX-512 registers
+ * depending on the instruction sets enabled at compile time, and falls
+ * back to scalar code otherwise. Unused lanes hold degenerate triangles
+ * (all zero), which are never hit.
+ */
+template <int Width> struct PackedTriangles {
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    typedef Eigen::Map<const FloatN> MapN;
+
+    float p0[3][Width];     ///< First vertex
+    float edge1[3][Width];  ///< First edge sharing the first vertex
+    float edge2[3][Width];  ///< Second edge sharing the first vertex
+    uint32_t mesh[Width];   ///< Mesh index (user defined)
+    uint32_t index[Width];  ///< Triangle index within the mesh
+
+    /**
+     * \brief Vectorized version of \ref Mesh::rayIntersect()
+     *
+     * \return The lane of the closest intersection, or -1 if no triangle
+     *    of the group is hit. On success, \c u, \c v and \c t are set
+     *    as in the scalar version.
+     */
+    int rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+        MapN p0x(p0[0]), p0y(p0[1]), p0z(p0[2]);
+        MapN e1x(edge1[0]), e1y(edge1[1]), e1z(edge1[2]);
+        MapN e2x(edge2[0]), e2y(edge2[1]), e2z(edge2[2]);
+
+        /* Begin calculating determinant - also used to calculate U parameter */
+        FloatN pvecX = ray.d.y() * e2z - ray.d.z() * e2y;
+        FloatN pvecY = ray.d.z() * e2x - ray.d.x() * e2z;
+        FloatN pvecZ = ray.d.x() * e2y - ray.d.y() * e2x;
+
+        FloatN det = e1x * pvecX + e1y * pvecY + e1z * pvecZ;
+        FloatN invDet = det.inverse();
+
+        /* Calculate distance from v[0] to ray origin */
+        FloatN tvecX = ray.o.x() - p0x, tvecY = ray.o.y() - p0y, tvecZ = ray.o.z() - p0z;
+
+        /* Calculate U and V parameters, and the distance */
+        FloatN uN = (tvecX * pvecX + tvecY * pvecY + tvecZ * pvecZ) * invDet;
+
+        FloatN qvecX = tvecY * e1z - tvecZ * e1y;
+        FloatN qvecY = tvecZ * e1x - tvecX * e1z;
+        FloatN qvecZ = tvecX * e1y - tvecY * e1x;
+
+        FloatN vN = (ray.d.x() * qvecX + ray.d.y() * qvecY + ray.d.z() * qvecZ) * invDet;
+        FloatN tN = (e2x * qvecX + e2y * qvecY + e2z * qvecZ) * invDet;
+
+        /* Same tests as in the scalar version, for all lanes at once */
+        Eigen::Array<bool, Width, 1> valid = (det.abs() >= 1e-8f) && (uN >= 0.f) && (uN <= 1.f) &&
+                     (vN >= 0.f) && (uN + vN <= 1.f) &&
+                     (tN >= ray.mint) && (tN <= ray.maxt);
+        if (!valid.any())
+            return -1;
+
+        int lane;
+        valid.select(tN, FloatN::Constant(std::numeric_limits<float>::infinity()))
+            .minCoeff(&lane);
+        u = uN[lane];
+        v = vN[lane];
+        t = tN[lane];
+        return lane;
+    }
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -35,6 +105,18 @@ NORI_NAMESPACE_BEGIN
  */
 class Mesh : public NoriObject {
 public:
+    /// Storage format of the vertex normals
+    enum ENormalStorage {
+        EFloatNormals = 0,  ///< Three 32-bit floats per vertex
+        EOctahedralNormals  ///< Octahedral mapping, two 16-bit components per vertex
+    };
+
+    /// Storage format of the texture coordinates
+    enum ETexCoordStorage {
+        EFloatTexCoords = 0, ///< Two 32-bit floats per vertex
+        EHalfTexCoords       ///< Two 16-bit floats per vertex
+    };
+
     /// Release all memory
     virtual ~Mesh();
 
@@ -42,7 +124,9 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this hsape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const {
+        return (uint32_t) (m_F16.size() > 0 ? m_F16.cols() : m_F.cols());
+    }
 
     /// Return the total number of vertices in this hsape
     uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
@@ -53,6 +137,16 @@ public:
      */
     void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const;
 
+    /**
+     * \brief Sample a triangle proportionally to its surface area
+     *
+     * The sample is adjusted so that it can be reused
+     * (see \ref DiscretePDF::sampleAliasReuse())
+     */
+    uint32_t sampleTriangle(float &sample) const {
+        return (uint32_t) m_areaPDF.sampleAliasReuse(sample);
+    }
+
     /// Return the surface area of the given triangle
     float surfaceArea(uint32_t index) const;
     float getTotalArea() const { return m_totalArea; }
@@ -93,18 +187,102 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+    /**
+     * \brief Ray-triangle intersection test (Moeller-Trumbore) for a
+     * triangle given by one vertex and the two edges sharing it
+     *
+     * This is the test used by \ref rayIntersect(); it is also called
+     * directly by \ref Accel for triangles that were copied into the leaves.
+     * The parameters and return value are the same as above.
+     */
+    static bool rayIntersect(const Point3f &p0, const Vector3f &edge1,
+            const Vector3f &edge2, const Ray3f &ray, float &u, float &v, float &t) {
+        /* Begin calculating determinant - also used to calculate U parameter */
+        Vector3f pvec = ray.d.cross(edge2);
+
+        /* If determinant is near zero, ray lies in plane of triangle */
+        float det = edge1.dot(pvec);
+
+        if (det > -1e-8f && det < 1e-8f)
+            return false;
+        float inv_det = 1.0f / det;
+
+        /* Calculate distance from v[0] to ray origin */
+        Vector3f tvec = ray.o - p0;
+
+        /* Calculate U parameter and test bounds */
+        u = tvec.dot(pvec) * inv_det;
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        /* Prepare to test V parameter */
+        Vector3f qvec = tvec.cross(edge1);
+
+        /* Calculate V parameter and test bounds */
+        v = ray.d.dot(qvec) * inv_det;
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+
+        /* Ray intersects triangle -> compute t */
+        t = edge2.dot(qvec) * inv_det;
+
+        return t >= ray.mint && t <= ray.maxt;
+    }
+
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
+    /**
+     * \brief Return a pointer to the vertex normals (or \c nullptr if there
+     * are none or if they are stored in compressed form)
+     */
     const MatrixXf &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
+    /**
+     * \brief Return a pointer to the texture coordinates (or \c nullptr if
+     * there are none or if they are stored in compressed form)
+     */
     const MatrixXf &getVertexTexCoords() const { return m_UV; }
 
-    /// Return a pointer to the triangle vertex index list
+    /// Return a pointer to the 32-bit triangle vertex index list (empty if 16-bit indices are used)
     const MatrixXu &getIndices() const { return m_F; }
 
+    /// Return a pointer to the 16-bit triangle vertex index list (empty if 32-bit indices are used)
+    const MatrixXu16 &getCompactIndices() const { return m_F16; }
+
+    /// Return the vertex indices of the given triangle, regardless of the index format
+    void getTriangle(uint32_t index, uint32_t &i0, uint32_t &i1, uint32_t &i2) const {
+        if (m_F16.size() > 0) {
+            i0 = m_F16(0, index); i1 = m_F16(1, index); i2 = m_F16(2, index);
+        } else {
+            i0 = m_F(0, index); i1 = m_F(1, index); i2 = m_F(2, index);
+        }
+    }
+
+    /// Does the mesh provide per-vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || m_Noct.size() > 0; }
+
+    /// Return the normal of the given vertex, regardless of the storage format
+    Normal3f getVertexNormal(uint32_t index) const {
+        if (m_Noct.size() > 0)
+            return decodeOctahedral(m_Noct(0, index));
+        return m_N.col(index);
+    }
+
+    /// Does the mesh provide per-vertex texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || m_UV16.size() > 0; }
+
+    /// Return the texture coordinates of the given vertex, regardless of the storage format
+    Point2f getVertexTexCoord(uint32_t index) const {
+        if (m_UV16.size() > 0) {
+            half u, v;
+            u.setBits(m_UV16(0, index));
+            v.setBits(m_UV16(1, index));
+            return Point2f((float) u, (float) v);
+        }
+        return m_UV.col(index);
+    }
+
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
 
@@ -136,12 +314,58 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Load the mesh data from a binary cache file (see \ref CacheReader)
+     *
+     * \return \c false if the file doesn't exist or doesn't match \c key
+     */
+    bool loadFromCache(const std::string &filename, uint64_t key);
+
+    /// Store the mesh data in a binary cache file (see \ref CacheWriter)
+    bool saveToCache(const std::string &filename, uint64_t key) const;
+
+    /**
+     * \brief Read the vertex storage options of a mesh
+     *
+     * The conversion itself happens at the end of \ref activate(), once
+     * all data is loaded. Supported properties are \c normalStorage
+     * (\c "float" or \c "octahedral"), \c texcoordStorage (\c "float"
+     * or \c "half") and \c compactIndices (16-bit indices for meshes with
+     * at most 65536 vertices).
+     */
+    void setStorage(const PropertyList &propList);
+
+    /// Convert the normals, texture coordinates and indices into the requested formats
+    void compressStorage();
+
+    /// Octahedral encoding of a unit vector into two 16-bit signed components
+    static uint32_t encodeOctahedral(const Normal3f &n);
+
+    /// Inverse of \ref encodeOctahedral()
+    static Normal3f decodeOctahedral(uint32_t value) {
+        Normal3f n((int16_t) (value & 0xFFFF) * (1.f / 32767.f),
+                   (int16_t) (value >> 16) * (1.f / 32767.f), 0.f);
+        n.z() = 1.f - std::abs(n.x()) - std::abs(n.y());
+        if (n.z() < 0.f) {
+            float x = n.x();
+            n.x() = std::copysign(1.f - std::abs(n.y()), x);
+            n.y() = std::copysign(1.f - std::abs(x), n.y());
+        }
+        return n.normalized();
+    }
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
     MatrixXf      m_N;                   ///< Vertex normals
     MatrixXf      m_UV;                  ///< Vertex texture coordinates
     MatrixXu      m_F;                   ///< Faces
+    MatrixXu      m_Noct;                ///< Octahedral vertex normals (replaces \ref m_N)
+    MatrixXu16    m_UV16;                ///< Half-float texture coordinates (replaces \ref m_UV)
+    MatrixXu16    m_F16;                 ///< 16-bit faces (replaces \ref m_F)
+    ENormalStorage m_normalStorage = EFloatNormals;
+    ETexCoordStorage m_texcoordStorage = EFloatTexCoords;
+    bool m_compactIndices = false;
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
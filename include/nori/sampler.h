@@ -74,8 +74,12 @@ public:
      * a new image block. This can be used to deterministically
      * initialize the sampler so that repeated program runs
      * always create the same image.
+     *
+     * \param pass
+     *    Index of the rendering pass. Adaptive sampling renders every
+     *    block several times, and each pass must use different samples.
      */
-    virtual void prepare(const ImageBlock &block) = 0;
+    virtual void prepare(const ImageBlock &block, uint32_t pass) = 0;
 
     /**
      * \brief Prepare to generate new samples
@@ -97,6 +101,24 @@ public:
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
+    /// Change the number of pixel samples (e.g. for a batch rendering job)
+    void setSampleCount(size_t sampleCount) {
+        m_sampleCount = sampleCount;
+        m_minSampleCount = std::min(m_minSampleCount, sampleCount);
+    }
+
+    /**
+     * \brief Return the relative error below which adaptive sampling stops
+     * rendering a pixel (0 if adaptive sampling is disabled)
+     *
+     * With adaptive sampling, \ref getSampleCount() is the maximal number
+     * of samples per pixel.
+     */
+    float getAdaptiveThreshold() const { return m_adaptiveThreshold; }
+
+    /// Return the number of samples every pixel receives with adaptive sampling
+    size_t getMinSampleCount() const { return m_minSampleCount; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
@@ -104,6 +126,8 @@ public:
     EClassType getClassType() const { return ESampler; }
 protected:
     size_t m_sampleCount;
+    size_t m_minSampleCount = 0;
+    float m_adaptiveThreshold = 0.f;
 };
 
 NORI_NAMESPACE_END
@@ -19,6 +19,10 @@
 #pragma once
 
 #include <nori/accel.h>
+#include <nori/tlas.h>
+#include <nori/dpdf.h>
+#include <nori/lightbvh.h>
+#include <unordered_map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -61,6 +65,33 @@ public:
     /// Return a reference to an array containing all emitters
     const std::vector<Emitter *> &getEmitters() const { return m_emitters; }
 
+    /// Return the number of emitters that can be chosen by \ref sampleEmitter()
+    size_t getEmitterCount() const { return m_lights.size(); }
+
+    /**
+     * \brief Choose an emitter for next event estimation at \c ref
+     *
+     * Depending on the \c lightSelection property of the scene, emitters
+     * are chosen proportionally to their emitted power ("power"), or to an
+     * estimate of their contribution to \c ref computed by traversing a
+     * light hierarchy ("bvh", see \ref LightBVH).
+     *
+     * \param ref
+     *    The shading point
+     *
+     * \param sample
+     *    A uniformly distributed sample on [0,1]
+     *
+     * \param pdf
+     *    Probability of choosing the returned emitter
+     *
+     * \return The chosen emitter, or \c nullptr if no emitter was chosen
+     */
+    const Emitter *sampleEmitter(const Point3f &ref, float sample, float &pdf) const;
+
+    /// Return the probability of \ref sampleEmitter() choosing \c emitter for \c ref
+    float emitterPdf(const Point3f &ref, const Emitter *emitter) const;
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -76,16 +107,9 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &_ray, Intersection &its) const {
-        bool hit=false;
         Ray3f ray(_ray);
         its.t = std::numeric_limits<float>::infinity();
-
-        for (auto shape : m_shapes)
-        {
-            bool _hit = shape->rayIntersect(ray, its, false);
-            hit = hit or _hit;
-        }
-        return hit;
+        return m_tlas.rayIntersect(ray, its, false);
     }
 
     /**
@@ -106,14 +130,37 @@ public:
     bool rayIntersect(const Ray3f &_ray) const {
         Intersection its; /* Unused */
         Ray3f ray(_ray);
-        for (auto shape : m_shapes)
-        {
-            if(shape->rayIntersect(ray, its, true))
-                return true;
-        }
-        return false;
+        return m_tlas.rayIntersect(ray, its, true);
     }
 
+    /**
+     * \brief Intersect a packet of rays against the scene and return
+     * detailed intersection information
+     *
+     * Tracing coherent rays together (e.g. the camera rays of an image
+     * block) shares BVH node visits among them, which is considerably
+     * faster than issuing the same queries one by one. Only the triangle
+     * BVH supports packets; the other shapes are intersected ray by ray,
+     * up to the closest triangle hit.
+     *
+     * \param rays
+     *    Array of \c count rays (at most \c NORI_PACKET_SIZE)
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled by
+     *    the intersection query
+     *
+     * \return A bit mask with bit \c i set if ray \c i hit something
+     */
+    uint64_t rayIntersect(const Ray3f *rays, Intersection *its, uint32_t count) const;
+
+    /**
+     * \brief Shadow ray version of the packet query
+     *
+     * \return A bit mask with bit \c i set if ray \c i is occluded
+     */
+    uint64_t rayIntersect(const Ray3f *rays, uint32_t count) const;
+
     /// \brief Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const {
         return m_bbox;
@@ -136,11 +183,19 @@ public:
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Shape *> m_shapes;
+    std::map<std::string, Shape *> m_prototypes; ///< Shapes that are only rendered through instances
     std::vector<Emitter *> m_emitters;
+    std::vector<const Emitter *> m_lights;    ///< Emitters chosen by sampleEmitter()
+    std::unordered_map<const Emitter *, uint32_t> m_lightIndex;
+    DiscretePDF m_lightPDF;                   ///< Light selection proportional to power
+    LightBVH m_lightBVH;                      ///< Light selection based on the shading point
+    bool m_useLightBVH = false;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    TopLevelAccel m_tlas;
+    TopLevelAccel m_packetTlas;               ///< Shapes other than the triangle BVH (see rayIntersect())
     BoundingBox3f m_bbox;
 };
 
@@ -22,6 +22,8 @@
 #include <nori/object.h>
 #include <nori/frame.h>
 #include <nori/bbox.h>
+#include <nori/emitter.h>
+#include <map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -49,9 +51,11 @@ struct Intersection {
     const BSDF *bsdf;
     /// pointer to the associated emitter
     const Emitter *emitter;
+    /// Index of the triangle that was hit (meshes only, <tt>(uint32_t) -1</tt> otherwise)
+    uint32_t primIndex;
 
     /// Create an uninitialized intersection record
-    Intersection() : bsdf(nullptr), emitter(nullptr) { }
+    Intersection() : bsdf(nullptr), emitter(nullptr), primIndex((uint32_t) -1) { }
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -100,6 +104,53 @@ public:
     //// Return an axis-aligned bounding box of the entire shape
     virtual const BoundingBox3f &getBoundingBox() const;
 
+    /// Return the identifier of the shape (empty if it has none)
+    const std::string &getId() const { return m_name; }
+
+    /**
+     * \brief Is this a prototype that is only rendered through instances?
+     *
+     * Prototypes are not added to the scene directly; instances refer
+     * to them by their identifier instead (see \ref resolveReferences()).
+     */
+    virtual bool isPrototype() const { return false; }
+
+    /**
+     * \brief Resolve references to prototype shapes
+     *
+     * Called by the scene once all of its children are known and before
+     * its acceleration structure is built. The default does nothing.
+     */
+    virtual void resolveReferences(const std::map<std::string, Shape *> &prototypes) { }
+
+    /// Return the emitter attached to the shape, if any
+    virtual const Emitter *getEmitter() const { return nullptr; }
+
+    /// Return the surface area of the shape (zero if it can't be sampled)
+    virtual float getSurfaceArea() const { return 0.f; }
+
+    /**
+     * \brief Sample a point on the surface as seen from \c lRec.ref
+     *
+     * Fills in \c lRec.p, \c lRec.n, \c lRec.wi and \c lRec.dist. Shapes
+     * may restrict the samples to the part of the surface that is visible
+     * from the reference point.
+     *
+     * \return The density of the sample (see \ref pdfSurface())
+     */
+    virtual float sampleSurface(EmitterQueryRecord &lRec, const Point2f &sample) const {
+        return 0.f;
+    }
+
+    /**
+     * \brief Return the density of \ref sampleSurface() choosing \c lRec.p
+     *
+     * Like \ref Emitter::pdf(), the density is expressed with respect to
+     * surface area, using the normal \c lRec.n for the conversion from
+     * solid angles.
+     */
+    virtual float pdfSurface(const EmitterQueryRecord &lRec) const { return 0.f; }
+
     /**
      * \brief Return the type of object (i.e. Shape/BSDF/etc.)
      * provided by this instance
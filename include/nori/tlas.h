@@ -0,0 +1,65 @@
+#pragma once
+
+#include <nori/shape.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Top-level acceleration structure over the shapes of a scene
+ *
+ * Every shape (analytic primitives, instances, the triangle \ref Accel, ..)
+ * is treated as a single primitive with the bounds reported by
+ * \ref Shape::getBoundingBox(). A binary SAH BVH over these bounds avoids
+ * testing every shape for every ray; the shapes themselves act as the
+ * bottom-level structures.
+ *
+ * Shapes without finite bounds (e.g. planes) can't be placed in the tree
+ * and are instead tested for every ray.
+ */
+class TopLevelAccel {
+public:
+    /// Build the hierarchy over the given shapes (which must be activated)
+    void build(const std::vector<Shape *> &shapes);
+
+    /// Release all memory
+    void clear();
+
+    /**
+     * \brief Intersect a ray against all shapes
+     *
+     * Same semantics as \ref Shape::rayIntersect(): on a hit, \c ray.maxt
+     * is reduced to the distance of the intersection. Shadow rays stop at
+     * the first occluder found anywhere in the hierarchy.
+     */
+    bool rayIntersect(Ray3f &ray, Intersection &its, bool shadowRay = false) const;
+
+    /// Return the bounds of all bounded shapes
+    const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+    /// Return a brief string summary of the structure
+    std::string toString() const;
+
+protected:
+    /// Binary BVH node (inner nodes store their children next to each other)
+    struct Node {
+        BoundingBox3f bbox;
+        uint32_t start;  ///< First shape (leaves) or left child (inner nodes)
+        uint32_t size;   ///< Number of shapes, zero for inner nodes
+
+        bool isLeaf() const { return size > 0; }
+    };
+
+    /// Maximum depth of the tree (bounds the traversal stack)
+    enum { MaxDepth = 63 };
+
+    /// Recursively build the subtree over the shapes in <tt>[start, end)</tt>
+    void buildRecursive(uint32_t nodeIdx, uint32_t start, uint32_t end, uint32_t depth);
+
+private:
+    std::vector<Shape *> m_shapes;     ///< Bounded shapes in tree order
+    std::vector<Shape *> m_unbounded;  ///< Shapes that are tested for every ray
+    std::vector<Node> m_nodes;         ///< BVH nodes (root at index 0)
+    BoundingBox3f m_bbox;              ///< Bounding box of the bounded shapes
+};
+
+NORI_NAMESPACE_END
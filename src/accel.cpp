@@ -18,9 +18,11 @@
 
 #include <nori/accel.h>
 #include <nori/timer.h>
+#include <nori/cache.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <functional>
 
 /*
  * =======================================================================
@@ -70,7 +72,10 @@ public:
         TRAVERSAL_COST = 1,
 
         /// Heuristic cost value for intersection operations
-        INTERSECTION_COST = 1
+        INTERSECTION_COST = 1,
+
+        /// Report the build progress for BVHs with at least 1M triangles
+        PROGRESS_THRESHOLD = 1 << 20
     };
 
 public:
@@ -103,7 +108,10 @@ public:
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
+            if (bvh.m_binnedBuild)
+                execute_binned_serially(bvh, node_idx, start, end, temp);
+            else
+                execute_serially(bvh, node_idx, start, end, temp);
             return nullptr;
         }
 
@@ -120,14 +128,14 @@ public:
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = bvh.m_primCentroid[axis][f];
 
                     int index = std::min(std::max(
                         (int) ((centroid - min) * inv_bin_size), 0),
                         (Bins::BIN_COUNT - 1));
 
                     result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
+                    result.bbox[index].expandBy(bvh.m_primBounds[f]);
                 }
                 return result;
             },
@@ -152,11 +160,12 @@ public:
 
         BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
         int64_t best_index = -1;
-        float best_cost = (float) INTERSECTION_COST * size;
+        float best_cost = (float) INTERSECTION_COST * leafCost(bvh, size);
         float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
 
         for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
+            uint32_t prims_left = leafCost(bvh, bins.counts[i]),
+                     prims_right = leafCost(bvh, (uint32_t) (end - start) - bins.counts[i]);
             float sah_cost = 2.0f * TRAVERSAL_COST +
                 tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
                               prims_right * bbox_right.getSurfaceArea());
@@ -194,7 +203,7 @@ public:
                 uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = bvh.m_primCentroid[axis][f];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     (index <= best_index ? count_left : count_right)++;
                 }
@@ -202,7 +211,7 @@ public:
                 uint32_t idx_r = offset_right.fetch_add(count_right);
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = bvh.m_primCentroid[axis][f];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     if (index <= best_index)
                         temp[idx_l++] = f;
@@ -232,25 +241,35 @@ public:
         return this;
     }
 
+    /**
+     * \brief Number of intersection tests needed for a leaf with \c size
+     * triangles (which are tested in groups with packed leaves)
+     */
+    static uint32_t leafCost(const Accel &bvh, uint32_t size) {
+        uint32_t align = bvh.getLeafAlignment();
+        return (size + align - 1) / align;
+    }
+
     /// Single-threaded build function
     static void execute_serially(Accel &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
         Accel::BVHNode &node = bvh.m_nodes[node_idx];
         uint32_t size = (uint32_t) (end - start);
-        float best_cost = (float) INTERSECTION_COST * size;
+        float best_cost = (float) INTERSECTION_COST * leafCost(bvh, size);
         int64_t best_index = -1, best_axis = -1;
         float *left_areas = (float *) temp;
 
         /* Try splitting along every axis */
         for (int axis=0; axis<3; ++axis) {
             /* Sort all triangles based on their centroid positions projected on the axis */
+            const float *centroids = bvh.m_primCentroid[axis].data();
             std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
+                return centroids[f1] < centroids[f2];
             });
 
             BoundingBox3f bbox;
             for (uint32_t i = 0; i<size; ++i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(bvh.m_primBounds[f]);
                 left_areas[i] = (float) bbox.getSurfaceArea();
             }
             if (axis == 0)
@@ -262,12 +281,12 @@ public:
             float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
             for (uint32_t i = size-1; i>=1; --i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(bvh.m_primBounds[f]);
 
                 float left_area = left_areas[i-1];
                 float right_area = bbox.getSurfaceArea();
-                uint32_t prims_left = i;
-                uint32_t prims_right = size-i;
+                uint32_t prims_left = leafCost(bvh, i);
+                uint32_t prims_right = leafCost(bvh, size-i);
 
                 float sah_cost = 2.0f * TRAVERSAL_COST +
                     tri_factor * (prims_left * left_area +
@@ -283,14 +302,13 @@ public:
 
         if (best_index == -1) {
             /* Splitting does not reduce the cost, make a leaf */
-            node.leaf.flag = 1;
-            node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
-            node.leaf.size  = size;
+            make_leaf(bvh, node, start, size);
             return;
         }
 
+        const float *centroids = bvh.m_primCentroid[best_axis].data();
         std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
+            return centroids[f1] < centroids[f2];
         });
 
         uint32_t left_count = (uint32_t) best_index;
@@ -303,8 +321,152 @@ public:
         execute_serially(bvh, node_idx_left, start, start + left_count, temp);
         execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
     }
+
+    /**
+     * \brief Single-threaded build function based on binning
+     *
+     * Evaluates 16 candidate split planes along each axis instead of all
+     * split positions, which avoids sorting the triangles.
+     */
+    static void execute_binned_serially(Accel &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
+        Accel::BVHNode &node = bvh.m_nodes[node_idx];
+        uint32_t size = (uint32_t) (end - start);
+
+        /* Bounds of the triangles and of their centroids */
+        BoundingBox3f bbox, centroid_bbox;
+        for (uint32_t *it = start; it != end; ++it) {
+            bbox.expandBy(bvh.m_primBounds[*it]);
+            centroid_bbox.expandBy(Point3f(bvh.m_primCentroid[0][*it],
+                bvh.m_primCentroid[1][*it], bvh.m_primCentroid[2][*it]));
+        }
+        node.bbox = bbox;
+
+        float best_cost = (float) INTERSECTION_COST * leafCost(bvh, size);
+        float tri_factor = (float) INTERSECTION_COST / bbox.getSurfaceArea();
+        int best_axis = -1, best_index = -1;
+        uint32_t best_left_count = 0;
+
+        for (int axis=0; axis<3; ++axis) {
+            float min = centroid_bbox.min[axis], max = centroid_bbox.max[axis];
+            if (!(max > min))
+                continue;
+            float inv_bin_size = Bins::BIN_COUNT / (max-min);
+            const float *centroids = bvh.m_primCentroid[axis].data();
+
+            Bins bins;
+            for (uint32_t *it = start; it != end; ++it) {
+                int index = std::min(std::max(
+                    (int) ((centroids[*it] - min) * inv_bin_size), 0),
+                    (Bins::BIN_COUNT - 1));
+                bins.counts[index]++;
+                bins.bbox[index].expandBy(bvh.m_primBounds[*it]);
+            }
+
+            BoundingBox3f bbox_left[Bins::BIN_COUNT];
+            bbox_left[0] = bins.bbox[0];
+            for (int i=1; i<Bins::BIN_COUNT; ++i) {
+                bins.counts[i] += bins.counts[i-1];
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[i]);
+            }
+
+            BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1];
+            for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
+                uint32_t count_left = bins.counts[i];
+                if (count_left > 0 && count_left < size) {
+                    float sah_cost = 2.0f * TRAVERSAL_COST +
+                        tri_factor * (leafCost(bvh, count_left) * bbox_left[i].getSurfaceArea() +
+                                      leafCost(bvh, size - count_left) * bbox_right.getSurfaceArea());
+                    if (sah_cost < best_cost) {
+                        best_cost = sah_cost;
+                        best_axis = axis;
+                        best_index = i;
+                        best_left_count = count_left;
+                    }
+                }
+                bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
+            }
+        }
+
+        /* Only called below SERIAL_THRESHOLD triangles, where a leaf is
+           always acceptable when no split beats it */
+        if (best_axis == -1) {
+            make_leaf(bvh, node, start, size);
+            return;
+        }
+
+        /* Partition with the same bin computation as above */
+        float min = centroid_bbox.min[best_axis],
+              inv_bin_size = Bins::BIN_COUNT / (centroid_bbox.max[best_axis] - min);
+        const float *centroids = bvh.m_primCentroid[best_axis].data();
+        std::partition(start, end, [&](uint32_t f) {
+            int index = std::min(std::max(
+                (int) ((centroids[f] - min) * inv_bin_size), 0),
+                (Bins::BIN_COUNT - 1));
+            return index <= best_index;
+        });
+
+        uint32_t left_count = best_left_count;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+
+        execute_binned_serially(bvh, node_idx_left, start, start + left_count, temp);
+        execute_binned_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+    }
+
+    /// Turn a node into a leaf that references the given triangles
+    static void make_leaf(Accel &bvh, Accel::BVHNode &node, uint32_t *start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
+        node.leaf.size  = size;
+        bvh.reportProgress(size);
+    }
 };
 
+Accel::Accel(const PropertyList &props) {
+    m_meshOffset.push_back(0u);
+    m_width = props.getInteger("bvhWidth", 4);
+    if (m_width != 2 && m_width != 4 && m_width != 8)
+        throw NoriException("Accel: unsupported BVH width %i (expected 2, 4 or 8)!", m_width);
+    m_quantization = props.getInteger("bvhCompression", 0);
+    if (m_quantization != 0 && m_quantization != 8 && m_quantization != 16)
+        throw NoriException("Accel: unsupported BVH compression %i (expected 0, 8 or 16)!",
+            m_quantization);
+    if (m_quantization != 0 && m_width == 2)
+        throw NoriException("Accel: BVH compression requires a bvhWidth of 4 or 8!");
+    std::string leaves = props.getString("bvhLeaves", "indexed");
+    if (leaves == "indexed")
+        m_leafStorage = EIndexedLeaves;
+    else if (leaves == "gathered")
+        m_leafStorage = EGatheredLeaves;
+    else if (leaves == "packed")
+        m_leafStorage = EPackedLeaves;
+    else
+        throw NoriException("Accel: unsupported leaf storage \"%s\" (expected "
+            "\"indexed\", \"gathered\" or \"packed\")!", leaves);
+    std::string builder = props.getString("bvhBuilder", "sweep");
+    if (builder != "sweep" && builder != "binned")
+        throw NoriException("Accel: unsupported BVH builder \"%s\" (expected "
+            "\"sweep\" or \"binned\")!", builder);
+    m_binnedBuild = builder == "binned";
+}
+
+template <> std::vector<Accel::WideBVHNode<4>> &Accel::wideNodes<4>() { return m_nodes4; }
+template <> std::vector<Accel::WideBVHNode<8>> &Accel::wideNodes<8>() { return m_nodes8; }
+template <> const std::vector<Accel::WideBVHNode<4>> &Accel::wideNodes<4>() const { return m_nodes4; }
+template <> const std::vector<Accel::WideBVHNode<8>> &Accel::wideNodes<8>() const { return m_nodes8; }
+
+template <> std::vector<Accel::QuantizedBVHNode<4, uint8_t>> &Accel::quantizedNodes<4, uint8_t>() { return m_qnodes4_8; }
+template <> std::vector<Accel::QuantizedBVHNode<4, uint16_t>> &Accel::quantizedNodes<4, uint16_t>() { return m_qnodes4_16; }
+template <> std::vector<Accel::QuantizedBVHNode<8, uint8_t>> &Accel::quantizedNodes<8, uint8_t>() { return m_qnodes8_8; }
+template <> std::vector<Accel::QuantizedBVHNode<8, uint16_t>> &Accel::quantizedNodes<8, uint16_t>() { return m_qnodes8_16; }
+template <> const std::vector<Accel::QuantizedBVHNode<4, uint8_t>> &Accel::quantizedNodes<4, uint8_t>() const { return m_qnodes4_8; }
+template <> const std::vector<Accel::QuantizedBVHNode<4, uint16_t>> &Accel::quantizedNodes<4, uint16_t>() const { return m_qnodes4_16; }
+template <> const std::vector<Accel::QuantizedBVHNode<8, uint8_t>> &Accel::quantizedNodes<8, uint8_t>() const { return m_qnodes8_8; }
+template <> const std::vector<Accel::QuantizedBVHNode<8, uint16_t>> &Accel::quantizedNodes<8, uint16_t>() const { return m_qnodes8_16; }
+
 void Accel::addMesh(Mesh *mesh) {
     m_meshes.push_back(mesh);
     m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
@@ -318,9 +480,25 @@ void Accel::clear() {
     m_meshOffset.clear();
     m_meshOffset.push_back(0u);
     m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_qnodes4_8.clear();
+    m_qnodes4_16.clear();
+    m_qnodes8_8.clear();
+    m_qnodes8_16.clear();
+    m_triangles.clear();
+    m_packed.clear();
     m_indices.clear();
     m_bbox.reset();
     m_nodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_qnodes4_8.shrink_to_fit();
+    m_qnodes4_16.shrink_to_fit();
+    m_qnodes8_8.shrink_to_fit();
+    m_qnodes8_16.shrink_to_fit();
+    m_triangles.shrink_to_fit();
+    m_packed.shrink_to_fit();
     m_meshes.shrink_to_fit();
     m_meshOffset.shrink_to_fit();
     m_indices.shrink_to_fit();
@@ -334,7 +512,65 @@ void Accel::activate() {
         << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
         << size << " triangles) .. ";
     cout.flush();
-    Timer timer;
+    Timer timer, phase;
+
+    /* Reuse a previously built tree if the triangles and the build
+       settings are unchanged */
+    std::string cacheFile;
+    uint64_t cacheKey = 0;
+    if (!getCacheDirectory().empty()) {
+        cacheKey = getCacheKey();
+        cacheFile = getCacheFilename("bvh", cacheKey);
+    }
+
+    std::pair<float, uint32_t> stats;
+    std::string prepareTime, buildTime;
+    if (!cacheFile.empty() && loadFromCache(cacheFile, cacheKey)) {
+        stats = statistics();
+        buildTime = phase.lapString();
+    } else {
+        /* Compute bounds and centroids of all triangles once */
+        prepareBuild();
+        prepareTime = phase.lapString();
+        build();
+        stats = statistics();
+        buildTime = phase.lapString();
+        if (!cacheFile.empty() && !saveToCache(cacheFile, cacheKey))
+            cerr << "Warning: unable to write the BVH cache \"" << cacheFile << "\"" << endl;
+    }
+    finalize();
+
+    size_t nodeMemory = sizeof(BVHNode) * m_nodes.size() +
+        sizeof(WideBVHNode<4>) * m_nodes4.size() +
+        sizeof(WideBVHNode<8>) * m_nodes8.size() +
+        sizeof(QuantizedBVHNode<4, uint8_t>) * m_qnodes4_8.size() +
+        sizeof(QuantizedBVHNode<4, uint16_t>) * m_qnodes4_16.size() +
+        sizeof(QuantizedBVHNode<8, uint8_t>) * m_qnodes8_8.size() +
+        sizeof(QuantizedBVHNode<8, uint16_t>) * m_qnodes8_16.size();
+
+    cout << "done (took " << timer.elapsedString();
+    if (prepareTime.empty())
+        cout << " [loaded from cache in " << buildTime;
+    else
+        cout << " [prepare " << prepareTime << ", build " << buildTime;
+    cout << ", finalize " << phase.elapsedString() << "] and "
+        << memString(nodeMemory + sizeof(uint32_t)*m_indices.size() +
+                     sizeof(LeafTriangle)*m_triangles.size() +
+                     sizeof(m_packed[0])*m_packed.size())
+        << ", SAH cost = " << stats.first;
+    if (m_width > 2)
+        cout << ", " << m_width << "-wide";
+    if (m_quantization > 0)
+        cout << ", " << m_quantization << "-bit quantized";
+    if (m_leafStorage == EGatheredLeaves)
+        cout << ", gathered leaves";
+    else if (m_leafStorage == EPackedLeaves)
+        cout << ", packed leaves (" << NORI_TRIANGLE_SIMD_WIDTH << "-wide)";
+    cout << ")." << endl;
+}
+
+void Accel::build() {
+    uint32_t size = getTriangleCount();
 
     /* Conservative estimate for the total number of nodes */
     m_nodes.resize(2*size);
@@ -355,6 +591,11 @@ void Accel::activate() {
     delete[] temp;
     std::pair<float, uint32_t> stats = statistics();
 
+    /* The build caches are not needed anymore */
+    for (int k = 0; k < 3; ++k)
+        std::vector<float>().swap(m_primCentroid[k]);
+    std::vector<BoundingBox3f>().swap(m_primBounds);
+
     /* The node array was allocated conservatively and now contains
        many unused entries -- do a compactification pass. */
     std::vector<BVHNode> compactified(stats.second);
@@ -373,14 +614,259 @@ void Accel::activate() {
                 (skipped - skipped_accum[new_node.inner.rightChild]));
         }
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
-
     m_nodes = std::move(compactified);
 }
 
+uint64_t Accel::getCacheKey() const {
+    /* Everything that influences the binary tree: the triangles and the
+       build settings (but not the settings of the later conversion steps) */
+    uint32_t settings[3] = { (uint32_t) sizeof(BVHNode), getLeafAlignment(),
+                             m_binnedBuild ? 1u : 0u };
+    uint64_t key = hashBytes(settings, sizeof(settings));
+    for (const Mesh *mesh : m_meshes) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        const MatrixXu16 &F16 = mesh->getCompactIndices();
+        uint64_t dims[2] = { (uint64_t) V.cols(), (uint64_t) mesh->getTriangleCount() };
+        key = hashBytes(dims, sizeof(dims), key);
+        key = hashBytes(V.data(), sizeof(float) * V.size(), key);
+        key = hashBytes(F.data(), sizeof(uint32_t) * F.size(), key);
+        key = hashBytes(F16.data(), sizeof(uint16_t) * F16.size(), key);
+    }
+    return key;
+}
+
+bool Accel::loadFromCache(const std::string &filename, uint64_t key) {
+    CacheReader reader(filename, key);
+    if (!reader.isValid())
+        return false;
+
+    try {
+        reader.read(m_nodes);
+        reader.read(m_indices);
+        if (m_nodes.empty() || m_indices.size() != getTriangleCount())
+            throw NoriException("Accel: the cached BVH doesn't match the scene!");
+    } catch (const NoriException &) {
+        m_nodes.clear();
+        m_indices.clear();
+        return false;
+    }
+    return true;
+}
+
+bool Accel::saveToCache(const std::string &filename, uint64_t key) const {
+    CacheWriter writer(filename, key);
+    writer.write(m_nodes);
+    writer.write(m_indices);
+    return writer.commit();
+}
+
+void Accel::finalize() {
+    if (m_leafStorage == EPackedLeaves)
+        alignLeaves();
+
+    /* Optionally collapse the binary tree into a wide BVH. The binary
+       nodes are only needed for traversal when m_width == 2 */
+    if (m_width == 4)
+        collapse<4>();
+    else if (m_width == 8)
+        collapse<8>();
+
+    /* Optionally replace the wide nodes by their quantized version */
+    if (m_width == 4 && m_quantization == 8)
+        compress<4, uint8_t>();
+    else if (m_width == 4 && m_quantization == 16)
+        compress<4, uint16_t>();
+    else if (m_width == 8 && m_quantization == 8)
+        compress<8, uint8_t>();
+    else if (m_width == 8 && m_quantization == 16)
+        compress<8, uint16_t>();
+
+    /* Copy the triangles into the leaves, which replaces the index references */
+    if (m_leafStorage == EGatheredLeaves) {
+        m_triangles.resize(m_indices.size());
+        for (size_t i = 0; i < m_indices.size(); ++i) {
+            uint32_t idx = m_indices[i];
+            uint32_t meshIdx = findMesh(idx);
+            const MatrixXf &V = m_meshes[meshIdx]->getVertexPositions();
+            uint32_t i0, i1, i2;
+            m_meshes[meshIdx]->getTriangle(idx, i0, i1, i2);
+            const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
+
+            LeafTriangle &tri = m_triangles[i];
+            tri.p0 = p0;
+            tri.edge1 = p1 - p0;
+            tri.edge2 = p2 - p0;
+            tri.mesh = meshIdx;
+            tri.index = idx;
+        }
+        m_indices.clear();
+        m_indices.shrink_to_fit();
+    } else if (m_leafStorage == EPackedLeaves) {
+        const uint32_t width = NORI_TRIANGLE_SIMD_WIDTH;
+        m_packed.resize(m_indices.size() / width);
+        memset(m_packed.data(), 0, sizeof(m_packed[0]) * m_packed.size());
+
+        for (size_t i = 0; i < m_indices.size(); ++i) {
+            uint32_t idx = m_indices[i];
+            if (idx == PaddingIndex)
+                continue; /* Leave a degenerate triangle */
+            uint32_t meshIdx = findMesh(idx);
+            const MatrixXf &V = m_meshes[meshIdx]->getVertexPositions();
+            uint32_t i0, i1, i2;
+            m_meshes[meshIdx]->getTriangle(idx, i0, i1, i2);
+            const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
+            const Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+
+            PackedTriangles<NORI_TRIANGLE_SIMD_WIDTH> &group = m_packed[i / width];
+            uint32_t lane = i % width;
+            for (int k = 0; k < 3; ++k) {
+                group.p0[k][lane] = p0[k];
+                group.edge1[k][lane] = edge1[k];
+                group.edge2[k][lane] = edge2[k];
+            }
+            group.mesh[lane] = meshIdx;
+            group.index[lane] = idx;
+        }
+        m_indices.clear();
+        m_indices.shrink_to_fit();
+    }
+}
+
+void Accel::alignLeaves() {
+    const uint32_t align = getLeafAlignment();
+    std::vector<uint32_t> indices;
+    indices.reserve(m_indices.size() + m_nodes.size() * (align - 1) / 2);
+
+    for (BVHNode &node : m_nodes) {
+        if (!node.isLeaf())
+            continue;
+        uint32_t start = (uint32_t) indices.size();
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            indices.push_back(m_indices[i]);
+        while (indices.size() % align != 0)
+            indices.push_back(PaddingIndex);
+        node.leaf.start = start;
+        node.leaf.size = (uint32_t) indices.size() - start;
+    }
+
+    m_indices = std::move(indices);
+}
+
+void Accel::prepareBuild() {
+    uint32_t size = getTriangleCount();
+    for (int k = 0; k < 3; ++k)
+        m_primCentroid[k].resize(size);
+    m_primBounds.resize(size);
+
+    m_buildProgress = 0;
+    m_progressReported = 0;
+
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t idx = i;
+                const Mesh *mesh = m_meshes[findMesh(idx)];
+                Point3f centroid = mesh->getCentroid(idx);
+                for (int k = 0; k < 3; ++k)
+                    m_primCentroid[k][i] = centroid[k];
+                m_primBounds[i] = mesh->getBoundingBox(idx);
+            }
+        }
+    );
+}
+
+void Accel::reportProgress(uint32_t count) {
+    uint32_t total = getTriangleCount();
+    if (total < BVHBuildTask::PROGRESS_THRESHOLD)
+        return;
+
+    uint32_t done = m_buildProgress.fetch_add(count) + count;
+    int percent = (int) (10 * (uint64_t) done / total) * 10;
+    int reported = m_progressReported;
+    while (percent > reported) {
+        if (m_progressReported.compare_exchange_weak(reported, percent)) {
+            cout << percent << "% ";
+            cout.flush();
+            break;
+        }
+    }
+}
+
+template <int Width> void Accel::collapse() {
+    typedef WideBVHNode<Width> Node;
+    std::vector<Node> &nodes = wideNodes<Width>();
+    nodes.clear();
+    nodes.reserve(m_nodes.size() / (Width - 1) + 1);
+
+    /* Recursively convert binary subtrees into wide nodes. Starting from
+       the two children of a binary inner node, the inner child with the
+       largest surface area is repeatedly replaced by its own two children
+       until all slots are filled or only leaves remain. */
+    std::function<uint32_t(const uint32_t *, int)> build =
+        [&](const uint32_t *binChildren, int count) -> uint32_t {
+        uint32_t children[Width];
+        for (int i = 0; i < count; ++i)
+            children[i] = binChildren[i];
+
+        while (count < Width) {
+            int best = -1;
+            float bestArea = -1.f;
+            for (int i = 0; i < count; ++i) {
+                const BVHNode &node = m_nodes[children[i]];
+                if (node.isInner() && node.bbox.getSurfaceArea() > bestArea) {
+                    bestArea = node.bbox.getSurfaceArea();
+                    best = i;
+                }
+            }
+            if (best < 0)
+                break;
+            uint32_t idx = children[best];
+            children[best] = idx + 1;
+            children[count++] = m_nodes[idx].inner.rightChild;
+        }
+
+        uint32_t nodeIdx = (uint32_t) nodes.size();
+        nodes.emplace_back();
+
+        for (int i = 0; i < Width; ++i) {
+            uint32_t childIdx = 0, size = 0;
+            BoundingBox3f bbox;
+
+            if (i < count) {
+                const BVHNode &node = m_nodes[children[i]];
+                bbox = node.bbox;
+                if (node.isLeaf()) {
+                    childIdx = node.start();
+                    size = node.leaf.size;
+                } else {
+                    uint32_t grandChildren[2] = { children[i] + 1, node.inner.rightChild };
+                    childIdx = build(grandChildren, 2);
+                }
+            }
+
+            /* Note: 'nodes' may have been reallocated by the recursion */
+            Node &wide = nodes[nodeIdx];
+            for (int k = 0; k < 3; ++k) {
+                wide.bounds[Node::EMinX + k][i] = bbox.min[k];
+                wide.bounds[Node::EMaxX + k][i] = bbox.max[k];
+            }
+            wide.child[i] = childIdx;
+            wide.size[i] = size;
+        }
+
+        return nodeIdx;
+    };
+
+    /* The root of the binary tree becomes the only child of the wide root */
+    uint32_t root = 0;
+    build(&root, 1);
+
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+}
+
 std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
     const BVHNode &node = m_nodes[node_idx];
     if (node.isLeaf()) {
@@ -401,20 +887,78 @@ std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
     }
 }
 
-bool Accel::rayIntersect(Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+bool Accel::intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+        Intersection &its, bool shadowRay, const Mesh *&hitmesh, uint32_t &f) const {
+    bool foundIntersection = false;
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+    if (m_leafStorage == EPackedLeaves) {
+        /* Leaves are aligned to the group size */
+        for (uint32_t i = start / NORI_TRIANGLE_SIMD_WIDTH,
+                      n = end / NORI_TRIANGLE_SIMD_WIDTH; i < n; ++i) {
+            const PackedTriangles<NORI_TRIANGLE_SIMD_WIDTH> &group = m_packed[i];
+
+            float u, v, t;
+            int lane = group.rayIntersect(ray, u, v, t);
+            if (lane >= 0) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+                hitmesh = m_meshes[group.mesh[lane]];
+                ray.maxt = its.t = t;
+                its.uv = Point2f(u, v);
+                its.bsdf = hitmesh->getBSDF();
+                its.emitter = hitmesh->getEmitter();
+                f = group.index[lane];
+            }
+        }
+        return foundIntersection;
+    }
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+    if (m_leafStorage == EGatheredLeaves) {
+        for (uint32_t i = start; i < end; ++i) {
+            const LeafTriangle &tri = m_triangles[i];
+
+            float u, v, t;
+            if (Mesh::rayIntersect(tri.p0, tri.edge1, tri.edge2, ray, u, v, t)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+                hitmesh = m_meshes[tri.mesh];
+                ray.maxt = its.t = t;
+                its.uv = Point2f(u, v);
+                its.bsdf = hitmesh->getBSDF();
+                its.emitter = hitmesh->getEmitter();
+                f = tri.index;
+            }
+        }
+        return foundIntersection;
+    }
 
+    for (uint32_t i = start; i < end; ++i) {
+        uint32_t idx = m_indices[i];
+        const Mesh *mesh = m_meshes[findMesh(idx)];
+
+        float u, v, t;
+        if (mesh->rayIntersect(idx, ray, u, v, t)) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+            hitmesh = mesh;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.bsdf = mesh->getBSDF();
+            its.emitter = mesh->getEmitter();
+            f = idx;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::traverseBinary(Ray3f &ray, Intersection &its, bool shadowRay,
+        const Mesh *&hitmesh, uint32_t &f) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
     bool foundIntersection = false;
-    const Mesh *hitmesh   = nullptr;
-    uint32_t f = 0;
 
     while (true) {
         const BVHNode &node = m_nodes[node_idx];
@@ -431,22 +975,11 @@ bool Accel::rayIntersect(Ray3f &_ray, Intersection &its, bool shadowRay) const {
             node_idx++;
             assert(stack_idx<64);
         } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Mesh *mesh = m_meshes[findMesh(idx)];
-
-                float u, v, t;
-                if (mesh->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    hitmesh=mesh;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.bsdf = mesh->getBSDF();
-                    its.emitter = mesh->getEmitter();
-                    f = idx;
-                }
+            if (intersectLeaf(node.start(), node.end(), ray, its,
+                              shadowRay, hitmesh, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
             }
             if (stack_idx == 0)
                 break;
@@ -455,58 +988,612 @@ bool Accel::rayIntersect(Ray3f &_ray, Intersection &its, bool shadowRay) const {
         }
     }
 
-    if (foundIntersection) {
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
+    return foundIntersection;
+}
 
-        /* References to all relevant mesh buffers */
-        const MatrixXf &V  = hitmesh->getVertexPositions();
-        const MatrixXf &N  = hitmesh->getVertexNormals();
-        const MatrixXf &UV = hitmesh->getVertexTexCoords();
-        const MatrixXu &F  = hitmesh->getIndices();
+/**
+ * \brief Quantize the bounds of \c count children relative to their union
+ *
+ * Rounds outwards and verifies every bound with the decoding expression
+ * used during traversal (with and without fused multiply-add), so that the
+ * decoded boxes always contain the original ones. The layout of \c qbounds
+ * matches \ref Accel::WideBVHNode::EBounds.
+ */
+template <int Width, typename QType> static void quantizeBounds(
+        const BoundingBox3f *bbox, int count, float origin[3], float scale[3],
+        QType qbounds[6][Width]) {
+    const float qmax = (float) std::numeric_limits<QType>::max();
+    BoundingBox3f parent;
+    for (int i = 0; i < count; ++i)
+        parent.expandBy(bbox[i]);
+
+    auto decodeLower = [](float o, float s, float q) {
+        return std::min(o + q * s, std::fma(q, s, o));
+    };
+    auto decodeUpper = [](float o, float s, float q) {
+        return std::max(o + q * s, std::fma(q, s, o));
+    };
 
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+    for (int k = 0; k < 3; ++k) {
+        float o = parent.min[k], extent = parent.max[k] - parent.min[k];
+        float s = extent > 0 ? extent / qmax : 0.f;
+
+        while (true) {
+            bool valid = true;
+            for (int i = 0; i < count && valid; ++i) {
+                float qlo = 0.f, qhi = 0.f;
+                if (s > 0) {
+                    qlo = std::max(0.f, std::min(qmax, std::floor((bbox[i].min[k] - o) / s)));
+                    qhi = std::max(0.f, std::min(qmax, std::ceil((bbox[i].max[k] - o) / s)));
+                    while (qlo > 0 && decodeUpper(o, s, qlo) > bbox[i].min[k])
+                        qlo -= 1;
+                    while (qhi < qmax && decodeLower(o, s, qhi) < bbox[i].max[k])
+                        qhi += 1;
+                }
+                valid = decodeUpper(o, s, qlo) <= bbox[i].min[k] &&
+                        decodeLower(o, s, qhi) >= bbox[i].max[k];
+                qbounds[k][i] = (QType) qlo;
+                qbounds[3 + k][i] = (QType) qhi;
+            }
+            if (valid)
+                break;
+            /* The largest bound is not reachable due to rounding; retry
+               with a slightly larger step size */
+            s = std::nextafter(s * (1.f + 1e-6f), std::numeric_limits<float>::infinity());
+        }
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+        origin[k] = o;
+        scale[k] = s;
+    }
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+    /* Unused child slots decode to an inverted box */
+    for (int i = count; i < Width; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            qbounds[k][i] = std::numeric_limits<QType>::max();
+            qbounds[3 + k][i] = 0;
+        }
+    }
+}
+
+template <int Width, typename QType> void Accel::compress() {
+    typedef WideBVHNode<Width> Node;
+    typedef QuantizedBVHNode<Width, QType> QNode;
+    const std::vector<Node> &nodes = wideNodes<Width>();
+
+    /* Work items, each of which turns into one quantized node: either a
+       wide node, or a range of primitives that exceeds the maximum leaf
+       size and is split among the children of an additional node. Nodes
+       are created in breadth-first order, which places the inner children
+       of every node next to each other. */
+    struct Item {
+        uint32_t node, start, size;
+        BoundingBox3f bbox;
+    };
+    std::vector<Item> items;
+    std::vector<QNode> qnodes;
+    std::vector<uint32_t> indices;
+    qnodes.reserve(nodes.size());
+    indices.reserve(m_indices.size());
+
+    items.push_back(Item { 0u, 0u, 0u, BoundingBox3f() });
+
+    for (size_t n = 0; n < items.size(); ++n) {
+        const Item item = items[n];
+        BoundingBox3f bbox[Width];
+        uint32_t child[Width], size[Width];
+        int count = 0;
+
+        if (item.size == 0) {
+            const Node &node = nodes[item.node];
+            for (int i = 0; i < Width; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    bbox[i].min[k] = node.bounds[Node::EMinX + k][i];
+                    bbox[i].max[k] = node.bounds[Node::EMaxX + k][i];
+                }
+                if (!bbox[i].isValid())
+                    break;
+                child[i] = node.child[i];
+                size[i] = node.size[i];
+                count++;
+            }
+        } else {
+            /* Split an oversized leaf (all parts share its bounds). The
+               parts must remain aligned with packed leaves. */
+            uint32_t align = getLeafAlignment();
+            uint32_t step = (item.size + Width - 1) / Width;
+            step = (step + align - 1) / align * align;
+            for (uint32_t start = item.start, end = item.start + item.size;
+                 start < end; start += step) {
+                bbox[count] = item.bbox;
+                child[count] = start;
+                size[count] = std::min(step, end - start);
+                count++;
+            }
+        }
+
+        QNode qnode;
+        quantizeBounds<Width, QType>(bbox, count, qnode.origin, qnode.scale, qnode.qbounds);
+        qnode.childBase = (uint32_t) items.size();
+        qnode.primBase = (uint32_t) indices.size();
+
+        for (int i = 0; i < Width; ++i) {
+            if (i >= count) {
+                qnode.size[i] = QNode::EEmpty;
+            } else if (size[i] == 0) {
+                items.push_back(Item { child[i], 0u, 0u, BoundingBox3f() });
+                qnode.size[i] = QNode::EInner;
+            } else if (size[i] > QNode::MaxLeafSize) {
+                items.push_back(Item { 0u, child[i], size[i], bbox[i] });
+                qnode.size[i] = QNode::EInner;
+            } else {
+                for (uint32_t j = 0; j < size[i]; ++j)
+                    indices.push_back(m_indices[child[i] + j]);
+                qnode.size[i] = (uint8_t) size[i];
+            }
+        }
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
+        qnodes.push_back(qnode);
+    }
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+    m_indices = std::move(indices);
+    quantizedNodes<Width, QType>() = std::move(qnodes);
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+    wideNodes<Width>().clear();
+    wideNodes<Width>().shrink_to_fit();
+}
 
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
+template <int Width> bool Accel::traverseWide(Ray3f &ray, Intersection &its,
+        bool shadowRay, const Mesh *&hitmesh, uint32_t &f, uint32_t root) const {
+    typedef WideBVHNode<Width> Node;
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    typedef Eigen::Map<const FloatN> MapN;
+
+    const std::vector<Node> &nodes = wideNodes<Width>();
+
+    /* Stack entries: child index, leaf size (0 for inner nodes), and
+       the entry distance along the ray */
+    struct Entry { uint32_t child, size; float t; };
+    Entry stack[64 * Width];
+    int stack_idx = 0;
+
+    /* Select the near and far slab of each axis based on the ray direction.
+       This also guarantees that empty child slots are never entered. */
+    int near[3], far[3];
+    for (int k = 0; k < 3; ++k) {
+        near[k] = ray.dRcp[k] >= 0 ? Node::EMinX + k : Node::EMaxX + k;
+        far[k]  = ray.dRcp[k] >= 0 ? Node::EMaxX + k : Node::EMinX + k;
+    }
+
+    bool foundIntersection = false;
+    stack[stack_idx++] = Entry { root, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        const Entry entry = stack[--stack_idx];
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.size > 0) {
+            if (intersectLeaf(entry.child, entry.child + entry.size, ray,
+                              its, shadowRay, hitmesh, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+
+        /* Vectorized slab test against all children */
+        FloatN tNear = ((MapN(node.bounds[near[0]]) - ray.o.x()) * ray.dRcp.x())
+            .max((MapN(node.bounds[near[1]]) - ray.o.y()) * ray.dRcp.y())
+            .max((MapN(node.bounds[near[2]]) - ray.o.z()) * ray.dRcp.z())
+            .max(ray.mint);
+        FloatN tFar = ((MapN(node.bounds[far[0]]) - ray.o.x()) * ray.dRcp.x())
+            .min((MapN(node.bounds[far[1]]) - ray.o.y()) * ray.dRcp.y())
+            .min((MapN(node.bounds[far[2]]) - ray.o.z()) * ray.dRcp.z())
+            .min(ray.maxt);
+
+        /* Sort the intersected children by distance (insertion sort) */
+        Entry hits[Width];
+        int hitCount = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (!(tNear[i] <= tFar[i]))
+                continue;
+            Entry hit { node.child[i], node.size[i], tNear[i] };
+            int j = hitCount++;
+            while (j > 0 && hits[j-1].t < hit.t) {
+                hits[j] = hits[j-1];
+                --j;
+            }
+            hits[j] = hit;
+        }
+
+        /* Push far-to-near, so that the nearest child is visited first */
+        for (int i = 0; i < hitCount; ++i)
+            stack[stack_idx++] = hits[i];
+        assert(stack_idx <= 64 * Width);
+    }
+
+    return foundIntersection;
+}
+
+template <int Width, typename QType> bool Accel::traverseQuantized(Ray3f &ray,
+        Intersection &its, bool shadowRay, const Mesh *&hitmesh, uint32_t &f) const {
+    typedef QuantizedBVHNode<Width, QType> Node;
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    typedef Eigen::Map<const Eigen::Array<QType, Width, 1>> MapQ;
+
+    const Node *nodes = quantizedNodes<Width, QType>().data();
+
+    struct Entry { uint32_t child, size; float t; };
+    Entry stack[64 * Width];
+    int stack_idx = 0;
+
+    /* Near and far slabs of each axis (see WideBVHNode::EBounds) */
+    int near[3], far[3];
+    for (int k = 0; k < 3; ++k) {
+        near[k] = ray.dRcp[k] >= 0 ? k : 3 + k;
+        far[k]  = ray.dRcp[k] >= 0 ? 3 + k : k;
+    }
+
+    bool foundIntersection = false;
+    stack[stack_idx++] = Entry { 0u, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        const Entry entry = stack[--stack_idx];
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.size > 0) {
+            if (intersectLeaf(entry.child, entry.child + entry.size, ray,
+                              its, shadowRay, hitmesh, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+
+        /* Decode the child bounds and intersect them with the ray */
+        auto slab = [&](int bound, int k) -> FloatN {
+            return (MapQ(node.qbounds[bound]).template cast<float>() * node.scale[k]
+                    + node.origin[k] - ray.o[k]) * ray.dRcp[k];
+        };
+        FloatN tNear = slab(near[0], 0).max(slab(near[1], 1))
+            .max(slab(near[2], 2)).max(ray.mint);
+        FloatN tFar = slab(far[0], 0).min(slab(far[1], 1))
+            .min(slab(far[2], 2)).min(ray.maxt);
+
+        /* Sort the intersected children by distance (insertion sort) */
+        Entry hits[Width];
+        int hitCount = 0;
+        uint32_t childIdx = node.childBase, primIdx = node.primBase;
+        for (int i = 0; i < Width; ++i) {
+            uint8_t size = node.size[i];
+            if (size == Node::EEmpty)
+                continue;
+
+            Entry hit;
+            if (size == Node::EInner) {
+                hit = Entry { childIdx++, 0u, tNear[i] };
+            } else {
+                hit = Entry { primIdx, size, tNear[i] };
+                primIdx += size;
+            }
+
+            if (!(tNear[i] <= tFar[i]))
+                continue;
+
+            int j = hitCount++;
+            while (j > 0 && hits[j-1].t < hit.t) {
+                hits[j] = hits[j-1];
+                --j;
+            }
+            hits[j] = hit;
+        }
+
+        /* Push far-to-near, so that the nearest child is visited first */
+        for (int i = 0; i < hitCount; ++i)
+            stack[stack_idx++] = hits[i];
+        assert(stack_idx <= 64 * Width);
+    }
+
+    return foundIntersection;
+}
+
+template <int Width> uint64_t Accel::traversePacket(Ray3f *rays, Intersection *its,
+        uint64_t active, bool shadowRay, const Mesh **hitmesh, uint32_t *f) const {
+    typedef WideBVHNode<Width> Node;
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    typedef Eigen::Map<const FloatN> MapN;
+
+    const std::vector<Node> &nodes = wideNodes<Width>();
+
+    /* All rays of the packet share the direction octant, hence
+       also the near and far slabs of each axis */
+    int first = 0;
+    while (!(active & (1ull << first)))
+        ++first;
+    int near[3], far[3];
+    for (int k = 0; k < 3; ++k) {
+        near[k] = rays[first].dRcp[k] >= 0 ? Node::EMinX + k : Node::EMaxX + k;
+        far[k]  = rays[first].dRcp[k] >= 0 ? Node::EMaxX + k : Node::EMinX + k;
+    }
+
+    /* Stack entries: child index, leaf size (0 for inner nodes), the rays
+       that entered the child, and their minimum entry distance */
+    struct Entry { uint32_t child, size; uint64_t mask; float t; };
+    Entry stack[64 * Width];
+    int stack_idx = 0;
+
+    Intersection unused;
+    uint64_t hits = 0, done = 0;
+    stack[stack_idx++] = Entry { 0u, 0u, active, 0.f };
+
+    while (stack_idx > 0) {
+        const Entry entry = stack[--stack_idx];
+
+        /* Occluded shadow rays don't need to be traced any further */
+        uint64_t mask = entry.mask & ~done;
+
+        /* Neither do rays that found a hit before the entry distance (which
+           is the minimum over the rays), so the node is skipped once all
+           of them did */
+        for (int i = 0; i < NORI_PACKET_SIZE; ++i) {
+            uint64_t bit = 1ull << i;
+            if ((mask & bit) && rays[i].maxt < entry.t)
+                mask &= ~bit;
+        }
+        if (!mask)
+            continue;
+
+        if (entry.size > 0) {
+            for (int i = 0; i < NORI_PACKET_SIZE; ++i) {
+                uint64_t bit = 1ull << i;
+                if (!(mask & bit))
+                    continue;
+                if (intersectLeaf(entry.child, entry.child + entry.size, rays[i],
+                        shadowRay ? unused : its[i], shadowRay, hitmesh[i], f[i])) {
+                    hits |= bit;
+                    if (shadowRay)
+                        done |= bit;
+                }
+            }
+            continue;
         }
 
-        if(hitmesh->isEmitter()) {
-            its.emitter=hitmesh->getEmitter();
+        /* The packet has diverged: a ray that is alone in this
+           subtree continues with single-ray traversal */
+        if ((mask & (mask - 1)) == 0) {
+            int i = 0;
+            while (!(mask & (1ull << i)))
+                ++i;
+            if (traverseWide<Width>(rays[i], shadowRay ? unused : its[i],
+                    shadowRay, hitmesh[i], f[i], entry.child)) {
+                hits |= 1ull << i;
+                if (shadowRay)
+                    done |= 1ull << i;
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        MapN nearX(node.bounds[near[0]]), nearY(node.bounds[near[1]]), nearZ(node.bounds[near[2]]);
+        MapN farX(node.bounds[far[0]]), farY(node.bounds[far[1]]), farZ(node.bounds[far[2]]);
+
+        uint64_t childMask[Width];
+        FloatN childT = FloatN::Constant(std::numeric_limits<float>::infinity());
+        for (int j = 0; j < Width; ++j)
+            childMask[j] = 0;
+
+        /* Vectorized slab test of each ray against all children */
+        for (int i = 0; i < NORI_PACKET_SIZE; ++i) {
+            uint64_t bit = 1ull << i;
+            if (!(mask & bit))
+                continue;
+            const Ray3f &ray = rays[i];
+
+            FloatN tNear = ((nearX - ray.o.x()) * ray.dRcp.x())
+                .max((nearY - ray.o.y()) * ray.dRcp.y())
+                .max((nearZ - ray.o.z()) * ray.dRcp.z())
+                .max(ray.mint);
+            FloatN tFar = ((farX - ray.o.x()) * ray.dRcp.x())
+                .min((farY - ray.o.y()) * ray.dRcp.y())
+                .min((farZ - ray.o.z()) * ray.dRcp.z())
+                .min(ray.maxt);
+
+            for (int j = 0; j < Width; ++j) {
+                if (tNear[j] <= tFar[j]) {
+                    childMask[j] |= bit;
+                    childT[j] = std::min(childT[j], tNear[j]);
+                }
+            }
+        }
+
+        /* Sort the intersected children by distance (insertion sort) */
+        Entry visit[Width];
+        int visitCount = 0;
+        for (int j = 0; j < Width; ++j) {
+            if (!childMask[j])
+                continue;
+            Entry e { node.child[j], node.size[j], childMask[j], childT[j] };
+            int k = visitCount++;
+            while (k > 0 && visit[k-1].t < e.t) {
+                visit[k] = visit[k-1];
+                --k;
+            }
+            visit[k] = e;
+        }
+
+        /* Push far-to-near, so that the nearest child is visited first */
+        for (int j = 0; j < visitCount; ++j)
+            stack[stack_idx++] = visit[j];
+        assert(stack_idx <= 64 * Width);
+    }
+
+    return hits;
+}
+
+uint64_t Accel::rayIntersectPacket(const Ray3f *_rays, Intersection *its,
+        uint32_t count, bool shadowRay) const {
+    if (count > NORI_PACKET_SIZE)
+        throw NoriException("Accel::rayIntersectPacket(): packet size %u exceeds "
+            "the maximum of %i rays!", count, NORI_PACKET_SIZE);
+
+    if (m_nodes.empty() && m_nodes4.empty() && m_nodes8.empty() && !hasQuantizedNodes())
+        return 0;
+
+    Ray3f rays[NORI_PACKET_SIZE];
+    const Mesh *hitmesh[NORI_PACKET_SIZE];
+    uint32_t f[NORI_PACKET_SIZE];
+    uint64_t active = 0;
+
+    /* Packet traversal requires the (uncompressed) wide BVH and
+       rays that share the same direction octant */
+    bool coherent = m_width > 2 && m_quantization == 0;
+    int octant = -1;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Ray3f &ray = rays[i];
+        ray = _rays[i];
+
+        /* Use an adaptive ray epsilon */
+        if (ray.mint == Epsilon)
+            ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+        if (ray.maxt < ray.mint)
+            continue;
+        active |= 1ull << i;
+        hitmesh[i] = nullptr;
+
+        int rayOctant = (ray.dRcp.x() < 0 ? 1 : 0) |
+                        (ray.dRcp.y() < 0 ? 2 : 0) |
+                        (ray.dRcp.z() < 0 ? 4 : 0);
+        if (octant < 0)
+            octant = rayOctant;
+        else if (octant != rayOctant)
+            coherent = false;
     }
+
+    if (!active)
+        return 0;
+
+    uint64_t hits = 0;
+    if (coherent) {
+        if (m_width == 4)
+            hits = traversePacket<4>(rays, its, active, shadowRay, hitmesh, f);
+        else
+            hits = traversePacket<8>(rays, its, active, shadowRay, hitmesh, f);
+
+        if (!shadowRay) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (hits & (1ull << i))
+                    finalizeIntersection(its[i], hitmesh[i], f[i]);
+            }
+        }
+    } else {
+        Intersection unused;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!(active & (1ull << i)))
+                continue;
+            Ray3f ray(_rays[i]);
+            if (rayIntersect(ray, shadowRay ? unused : its[i], shadowRay))
+                hits |= 1ull << i;
+        }
+    }
+
+    return hits;
+}
+
+bool Accel::rayIntersect(Ray3f &_ray, Intersection &its, bool shadowRay) const {
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if ((m_nodes.empty() && m_nodes4.empty() && m_nodes8.empty() && !hasQuantizedNodes()) ||
+        ray.maxt < ray.mint)
+        return false;
+
+    const Mesh *hitmesh = nullptr;
+    uint32_t f = 0;
+    bool foundIntersection;
+
+    if (m_quantization == 8 && m_width == 4)
+        foundIntersection = traverseQuantized<4, uint8_t>(ray, its, shadowRay, hitmesh, f);
+    else if (m_quantization == 16 && m_width == 4)
+        foundIntersection = traverseQuantized<4, uint16_t>(ray, its, shadowRay, hitmesh, f);
+    else if (m_quantization == 8 && m_width == 8)
+        foundIntersection = traverseQuantized<8, uint8_t>(ray, its, shadowRay, hitmesh, f);
+    else if (m_quantization == 16 && m_width == 8)
+        foundIntersection = traverseQuantized<8, uint16_t>(ray, its, shadowRay, hitmesh, f);
+    else if (m_width == 4)
+        foundIntersection = traverseWide<4>(ray, its, shadowRay, hitmesh, f);
+    else if (m_width == 8)
+        foundIntersection = traverseWide<8>(ray, its, shadowRay, hitmesh, f);
+    else
+        foundIntersection = traverseBinary(ray, its, shadowRay, hitmesh, f);
+
+    if (foundIntersection && !shadowRay) {
+        /* Let the caller cull other shapes against this hit */
+        _ray.maxt = its.t;
+        finalizeIntersection(its, hitmesh, f);
     }
 
     return foundIntersection;
 }
 
+void Accel::finalizeIntersection(Intersection &its, const Mesh *hitmesh, uint32_t f) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* Vertex indices of the triangle */
+    const MatrixXf &V = hitmesh->getVertexPositions();
+    uint32_t idx0, idx1, idx2;
+    hitmesh->getTriangle(f, idx0, idx1, idx2);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh
+       (decoding them if they are stored in compressed form) */
+    if (hitmesh->hasVertexTexCoords())
+        its.uv = bary.x() * hitmesh->getVertexTexCoord(idx0) +
+            bary.y() * hitmesh->getVertexTexCoord(idx1) +
+            bary.z() * hitmesh->getVertexTexCoord(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (hitmesh->hasVertexNormals()) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * hitmesh->getVertexNormal(idx0) +
+             bary.y() * hitmesh->getVertexNormal(idx1) +
+             bary.z() * hitmesh->getVertexNormal(idx2)).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
+
+    its.primIndex = f;
+
+    if(hitmesh->isEmitter()) {
+        its.emitter=hitmesh->getEmitter();
+    }
+}
+
 std::string Accel::toString() const {
     std::string meshes;
     for (size_t i=0; i<m_meshes.size(); ++i) {
@@ -1,41 +1,152 @@
 #include <nori/emitter.h>
 #include <nori/mesh.h>
+#include <nori/shape.h>
 #include <nori/object.h>
+#include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
 
+/* Spherical triangles outside of this range of solid angles are sampled by
+   area instead, where the computation of the angles loses its precision */
+static const float MinSphericalSampleArea = 3e-4f;
+static const float MaxSphericalSampleArea = 6.22f;
+
+/// Solid angle of the spherical triangle with the (unit) vertices A, B, C
+static float sphericalTriangleArea(const Vector3f &A, const Vector3f &B, const Vector3f &C) {
+    /* Van Oosterom and Strackee's formula */
+    return 2.f * std::atan2(std::abs(A.dot(B.cross(C))),
+                            1.f + A.dot(B) + B.dot(C) + C.dot(A));
+}
+
+/**
+ * \brief Uniformly sample a direction within the spherical triangle with
+ * the (unit) vertices A, B, C
+ *
+ * This is Arvo's method ("Stratified sampling of spherical triangles",
+ * SIGGRAPH 1995): the first sample dimension chooses the area of a
+ * sub-triangle ABC', and the second one a point on the arc from B to C'.
+ */
+static Vector3f sampleSphericalTriangle(const Vector3f &A, const Vector3f &B,
+                                        const Vector3f &C, const Point2f &sample) {
+    /* Interior angles, between the planes through the origin and two vertices */
+    Vector3f nAB = A.cross(B).normalized();
+    Vector3f nAC = A.cross(C).normalized();
+    Vector3f nBC = B.cross(C).normalized();
+    float alpha = std::acos(clamp(nAB.dot(nAC), -1.f, 1.f));
+    float beta  = std::acos(clamp(-nAB.dot(nBC), -1.f, 1.f));
+    float gamma = std::acos(clamp(nAC.dot(nBC), -1.f, 1.f));
+
+    /* Find the vertex C' of the sub-triangle with the sampled area */
+    float areaHat = sample.x() * (alpha + beta + gamma - M_PI);
+    float s = std::sin(areaHat - alpha), t = std::cos(areaHat - alpha);
+    float cosAlpha = std::cos(alpha), sinAlpha = std::sin(alpha);
+    float u = t - cosAlpha;
+    float v = s + sinAlpha * A.dot(B);
+    float denom = (v * s + u * t) * sinAlpha;
+    float q = denom != 0.f ? clamp(((v * t - u * s) * cosAlpha - v) / denom, -1.f, 1.f) : 1.f;
+    Vector3f CPerp = (C - C.dot(A) * A).normalized();
+    Vector3f CHat = q * A + std::sqrt(std::max(0.f, 1.f - q * q)) * CPerp;
+
+    /* Sample the arc from B to C' */
+    float z = clamp(1.f - sample.y() * (1.f - CHat.dot(B)), -1.f, 1.f);
+    Vector3f CHatPerp = CHat - CHat.dot(B) * B;
+    float norm = CHatPerp.norm();
+    if (norm == 0.f)
+        return B;
+    return z * B + std::sqrt(std::max(0.f, 1.f - z * z)) * (CHatPerp / norm);
+}
+
+/**
+ * \brief Emitter that radiates uniformly from the surface of a mesh
+ * or an analytic shape
+ *
+ * Points on meshes are sampled uniformly by surface area
+ * (<tt>sampling="area"</tt>, default), or by choosing a triangle by area
+ * and sampling the solid angle it subtends at the shading point
+ * (<tt>sampling="solidAngle"</tt>). The latter avoids the high variance
+ * of area sampling on large or nearby emitters, where most points are
+ * seen at grazing angles. Analytic shapes provide their own sampling
+ * strategy (see \ref Shape::sampleSurface()).
+ */
 class AreaLight : public Emitter {
 public:
     AreaLight(const PropertyList &props) {
         m_radiance = props.getColor("radiance", Color3f(1.f));
+
+        std::string sampling = props.getString("sampling", "area");
+        if (sampling == "area")
+            m_solidAngleSampling = false;
+        else if (sampling == "solidAngle")
+            m_solidAngleSampling = true;
+        else
+            throw NoriException("AreaLight: unsupported sampling strategy \"%s\" "
+                "(expected \"area\" or \"solidAngle\")!", sampling);
     }
 
     void setParent(NoriObject *obj) override {
         m_mesh = dynamic_cast<Mesh *>(obj);
-        if (!m_mesh)
-            throw NoriException("AreaLight must be attached to a mesh!");
+        m_shape = dynamic_cast<Shape *>(obj);
+        if (!m_mesh && !m_shape)
+            throw NoriException("AreaLight must be attached to a mesh or a shape!");
+        if (m_shape && !(m_shape->getSurfaceArea() > 0.f))
+            throw NoriException("AreaLight: the shape can't be sampled!");
     }
 
     Color3f sample(EmitterQueryRecord &lRec,
                    const Point2f &sample,
                    float &pdf) const override {
-        // Sample a point on the mesh
-        m_mesh->samplePosition(sample, lRec.p, lRec.n);
+        if (m_shape) {
+            // Let the shape sample a point
+            pdf = m_shape->sampleSurface(lRec, sample);
+        } else if (m_solidAngleSampling) {
+            // Sample a triangle, then a point on it as seen from the reference
+            float sampleX = sample.x();
+            lRec.primIndex = m_mesh->sampleTriangle(sampleX);
+            sampleTriangle(lRec, Point2f(sampleX, sample.y()));
+            pdf = this->pdf(lRec);
+        } else {
+            // Sample a point on the mesh
+            m_mesh->samplePosition(sample, lRec.p, lRec.n);
 
-        Vector3f d = lRec.p - lRec.ref;
-        lRec.dist = d.norm();
-        lRec.wi = d / lRec.dist;
+            Vector3f d = lRec.p - lRec.ref;
+            lRec.dist = d.norm();
+            lRec.wi = d / lRec.dist;
 
-        pdf = 1.f / m_mesh->getTotalArea();
+            pdf = 1.f / m_mesh->getTotalArea();
+        }
 
-        if (lRec.n.dot(-lRec.wi) <= 0.f)
+        if (!(pdf > 0.f) || lRec.n.dot(-lRec.wi) <= 0.f)
             return Color3f(0.f);
 
         return m_radiance;
     }
 
-    float pdf(const EmitterQueryRecord &) const override {
-        return 1.f / m_mesh->getTotalArea();
+    /**
+     * \brief Return the density of sampling \c lRec.p (w.r.t. area)
+     *
+     * With solid angle sampling, \c lRec.primIndex must specify the
+     * triangle containing the point. When it is <tt>(uint32_t) -1</tt>
+     * (no triangle known), the area density is returned instead.
+     */
+    float pdf(const EmitterQueryRecord &lRec) const override {
+        if (m_shape)
+            return m_shape->pdfSurface(lRec);
+
+        if (!m_solidAngleSampling || lRec.primIndex == (uint32_t) -1 ||
+            lRec.primIndex >= m_mesh->getTriangleCount())
+            return 1.f / m_mesh->getTotalArea();
+
+        Vector3f A, B, C;
+        float solidAngle = sphericalTriangle(lRec.primIndex, lRec.ref, A, B, C);
+        if (!(solidAngle >= MinSphericalSampleArea && solidAngle <= MaxSphericalSampleArea))
+            return 1.f / m_mesh->getTotalArea();
+
+        /* Triangle selection times the uniform density over the solid
+           angle, converted to area with the normal that the integrators
+           use in their geometry term (so that they recover the latter) */
+        float pdfTriangle = m_mesh->surfaceArea(lRec.primIndex) / m_mesh->getTotalArea();
+        return pdfTriangle / solidAngle *
+            std::abs(lRec.n.dot(lRec.wi)) / (lRec.dist * lRec.dist);
     }
 
     Color3f eval(const EmitterQueryRecord &lRec) const override {
@@ -44,18 +155,123 @@ public:
         return m_radiance;
     }
 
+    Color3f getPower() const override {
+        float area = m_shape ? m_shape->getSurfaceArea() : m_mesh->getTotalArea();
+        return m_radiance * area * M_PI;
+    }
+
+    BoundingBox3f getBoundingBox() const override {
+        return m_shape ? m_shape->getBoundingBox() : m_mesh->getBoundingBox();
+    }
+
+    float getEmissionCone(Vector3f &axis) const override {
+        if (m_shape)
+            return Emitter::getEmissionCone(axis);
+
+        /* Average direction of the (geometric) surface normals */
+        const MatrixXf &V = m_mesh->getVertexPositions();
+        Vector3f sum = Vector3f::Zero();
+        for (uint32_t i = 0; i < m_mesh->getTriangleCount(); ++i) {
+            uint32_t i0, i1, i2;
+            m_mesh->getTriangle(i, i0, i1, i2);
+            sum += Vector3f(V.col(i1) - V.col(i0)).cross(Vector3f(V.col(i2) - V.col(i0)));
+        }
+        axis = Vector3f(0.0f, 0.0f, 1.0f);
+        if (sum.norm() <= 1e-6f * m_mesh->getTotalArea())
+            return -1.0f;
+        axis = sum.normalized();
+
+        /* The cone must contain the geometric and the shading normals */
+        float cosTheta = 1.0f;
+        for (uint32_t i = 0; i < m_mesh->getTriangleCount(); ++i) {
+            uint32_t i0, i1, i2;
+            m_mesh->getTriangle(i, i0, i1, i2);
+            Vector3f n = Vector3f(V.col(i1) - V.col(i0)).cross(Vector3f(V.col(i2) - V.col(i0)));
+            if (n.squaredNorm() > 0.0f)
+                cosTheta = std::min(cosTheta, axis.dot(n.normalized()));
+        }
+        if (m_mesh->hasVertexNormals()) {
+            for (uint32_t i = 0; i < (uint32_t) V.cols(); ++i)
+                cosTheta = std::min(cosTheta, axis.dot(m_mesh->getVertexNormal(i).normalized()));
+        }
+        return std::max(cosTheta, -1.0f);
+    }
+
     std::string toString() const override {
         return tfm::format(
             "AreaLight[\n"
-            "  radiance = %s\n"
+            "  radiance = %s,\n"
+            "  sampling = %s\n"
             "]",
-            m_radiance.toString()
+            m_radiance.toString(),
+            m_solidAngleSampling ? "solidAngle" : "area"
         );
     }
 
 private:
+    /**
+     * \brief Compute the directions from \c ref towards the vertices of
+     * a triangle, and return the solid angle it subtends
+     */
+    float sphericalTriangle(uint32_t index, const Point3f &ref,
+                            Vector3f &A, Vector3f &B, Vector3f &C) const {
+        const MatrixXf &V = m_mesh->getVertexPositions();
+        uint32_t i0, i1, i2;
+        m_mesh->getTriangle(index, i0, i1, i2);
+        A = (Point3f(V.col(i0)) - ref).normalized();
+        B = (Point3f(V.col(i1)) - ref).normalized();
+        C = (Point3f(V.col(i2)) - ref).normalized();
+        return sphericalTriangleArea(A, B, C);
+    }
+
+    /// Sample a point on the triangle \c lRec.primIndex as seen from \c lRec.ref
+    void sampleTriangle(EmitterQueryRecord &lRec, const Point2f &sample) const {
+        const MatrixXf &V = m_mesh->getVertexPositions();
+        uint32_t f[3];
+        m_mesh->getTriangle(lRec.primIndex, f[0], f[1], f[2]);
+        Point3f p0 = V.col(f[0]), p1 = V.col(f[1]), p2 = V.col(f[2]);
+        Vector3f ng = (p1 - p0).cross(p2 - p0);
+
+        Vector3f A, B, C;
+        float solidAngle = sphericalTriangle(lRec.primIndex, lRec.ref, A, B, C);
+
+        Vector3f bary;
+        if (solidAngle >= MinSphericalSampleArea && solidAngle <= MaxSphericalSampleArea) {
+            /* Sample a direction and find the point on the triangle plane */
+            Vector3f d = sampleSphericalTriangle(A, B, C, sample);
+            float t = ng.dot(p0 - lRec.ref) / ng.dot(d);
+            lRec.p = lRec.ref + t * d;
+
+            /* Barycentric coordinates of the point (to interpolate the normal) */
+            Vector3f e1 = p1 - p0, e2 = p2 - p0, e = lRec.p - p0;
+            float d11 = e1.dot(e1), d12 = e1.dot(e2), d22 = e2.dot(e2);
+            float invDenom = 1.f / (d11 * d22 - d12 * d12);
+            float b1 = clamp((d22 * e1.dot(e) - d12 * e2.dot(e)) * invDenom, 0.f, 1.f);
+            float b2 = clamp((d11 * e2.dot(e) - d12 * e1.dot(e)) * invDenom, 0.f, 1.f - b1);
+            bary = Vector3f(1.f - b1 - b2, b1, b2);
+        } else {
+            /* Uniform barycentric sampling, as in Mesh::samplePosition() */
+            float r1 = std::sqrt(sample.x());
+            bary = Vector3f(1.f - r1, r1 * (1.f - sample.y()), r1 * sample.y());
+            lRec.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+        }
+
+        if (m_mesh->hasVertexNormals())
+            lRec.n = (bary.x() * m_mesh->getVertexNormal(f[0]) +
+                      bary.y() * m_mesh->getVertexNormal(f[1]) +
+                      bary.z() * m_mesh->getVertexNormal(f[2])).normalized();
+        else
+            lRec.n = ng.normalized();
+
+        Vector3f d = lRec.p - lRec.ref;
+        lRec.dist = d.norm();
+        lRec.wi = d / lRec.dist;
+    }
+
     Color3f m_radiance;
-    Mesh *m_mesh = nullptr;
+    Mesh *m_mesh = nullptr;     ///< Parent mesh, or
+    Shape *m_shape = nullptr;   ///< parent analytic shape
+    bool m_solidAngleSampling;
 };
 
 NORI_REGISTER_CLASS(AreaLight, "area")
@@ -21,6 +21,10 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -37,6 +41,12 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
         }
         m_filter[NORI_FILTER_RESOLUTION] = 0.0f;
         m_lookupFactor = NORI_FILTER_RESOLUTION / m_filterRadius;
+        /* A constant filter of at most half a pixel (i.e. the box filter) adds
+           each sample to the pixel containing it, with the same weight */
+        m_boxFilter = m_filterRadius <= 0.5f &&
+            std::all_of(m_filter, m_filter + NORI_FILTER_RESOLUTION,
+                        [this](float weight) { return weight == m_filter[0]; });
+        m_filterSize = m_boxFilter ? 1 : (int) std::floor(2*m_filterRadius) + 1;
         int weightSize = (int) std::ceil(2*m_filterRadius) + 1;
         m_weightsX = new float[weightSize];
         m_weightsY = new float[weightSize];
@@ -71,6 +81,82 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
             coeffRef(y, x) << bitmap.coeff(y, x), 1;
 }
 
+void ImageBlock::saveEXR(const std::string &filename, const Vector2i &imageSize) const {
+    /* Pixels of the block (including its border) that lie within the image */
+    Point2i origin = m_offset - Vector2i::Constant(m_borderSize);
+    Point2i min = origin.cwiseMax(Point2i(0, 0)),
+            max = (origin + Vector2i((int) cols(), (int) rows())).cwiseMin(imageSize) - Vector2i(1, 1);
+
+    cout << "Writing a partial " << max.x() - min.x() + 1 << "x" << max.y() - min.y() + 1
+         << " OpenEXR file to \"" << filename << "\"" << endl;
+
+    std::string path = filename + ".exr";
+
+    Imf::Header header(Imath::Box2i(Imath::V2i(0, 0), Imath::V2i(imageSize.x() - 1, imageSize.y() - 1)),
+                       Imath::Box2i(Imath::V2i(min.x(), min.y()), Imath::V2i(max.x(), max.y())));
+    header.insert("comments", Imf::StringAttribute("Generated by Nori (unnormalized, weights in W)"));
+
+    Imf::ChannelList &channels = header.channels();
+    channels.insert("R", Imf::Channel(Imf::FLOAT));
+    channels.insert("G", Imf::Channel(Imf::FLOAT));
+    channels.insert("B", Imf::Channel(Imf::FLOAT));
+    channels.insert("W", Imf::Channel(Imf::FLOAT));
+
+    /* OpenEXR addresses the pixels by their position in the image */
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * cols();
+    char *ptr = (char *) data() - origin.y() * (ptrdiff_t) rowStride
+                                - origin.x() * (ptrdiff_t) pixelStride;
+
+    Imf::FrameBuffer frameBuffer;
+    frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("W", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+
+    Imf::OutputFile file(path.c_str(), header);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(max.y() - min.y() + 1);
+}
+
+void ImageBlock::putEXR(const std::string &filename) {
+    Imf::InputFile file(filename.c_str());
+    const Imf::Header &header = file.header();
+    const Imf::ChannelList &channels = header.channels();
+    for (const char *name : { "R", "G", "B", "W" }) {
+        if (!channels.findChannel(name))
+            throw NoriException("\"%s\" is not a partial rendering (channel %s is missing)!",
+                                filename, name);
+    }
+
+    Imath::Box2i dw = header.dataWindow();
+    Point2i min(dw.min.x, dw.min.y), max(dw.max.x, dw.max.y);
+    Point2i origin = m_offset - Vector2i::Constant(m_borderSize);
+    if ((min.array() < origin.array()).any() ||
+        (max.array() >= (origin + Vector2i((int) cols(), (int) rows())).array()).any())
+        throw NoriException("\"%s\" doesn't fit into the image!", filename);
+
+    Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> pixels(
+        max.y() - min.y() + 1, max.x() - min.x() + 1);
+
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * pixels.cols();
+    char *ptr = (char *) pixels.data() - min.y() * (ptrdiff_t) rowStride
+                                       - min.x() * (ptrdiff_t) pixelStride;
+
+    Imf::FrameBuffer frameBuffer;
+    frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("W", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y, dw.max.y);
+
+    block(min.y() - origin.y(), min.x() - origin.x(), pixels.rows(), pixels.cols()) += pixels;
+}
+
 void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
     if (!value.isValid()) {
         /* If this happens, go fix your code instead of removing this warning ;) */
@@ -84,6 +170,61 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
         _pos.y() - 0.5f - (m_offset.y() - m_borderSize)
     );
 
+    switch (m_filterSize) {
+        case 1:
+            if (m_boxFilter)
+                putSingle(pos, value);
+            else
+                putFixed<1>(pos, value);
+            break;
+        case 2: putFixed<2>(pos, value); break;
+        case 3: putFixed<3>(pos, value); break;
+        case 4: putFixed<4>(pos, value); break;
+        case 5: putFixed<5>(pos, value); break;
+        default: putGeneric(pos, value); break;
+    }
+}
+
+void ImageBlock::putSingle(const Point2f &pos, const Color3f &value) {
+    /* Pixel centers lie at integer block coordinates */
+    int x = (int) std::floor(pos.x() + 0.5f),
+        y = (int) std::floor(pos.y() + 0.5f);
+    if (x < 0 || y < 0 || x >= cols() || y >= rows())
+        return;
+
+    coeffRef(y, x) += Color4f(value) * m_filter[0];
+}
+
+template <int N> void ImageBlock::putFixed(const Point2f &pos, const Color3f &value) {
+    /* The window starts at the first pixel within the filter radius. Pixels
+       at its end may lie outside of the radius; they get a zero weight */
+    int x0 = (int) std::ceil(pos.x() - m_filterRadius),
+        y0 = (int) std::ceil(pos.y() - m_filterRadius);
+    if (x0 < 0 || y0 < 0 || x0 + N > cols() || y0 + N > rows()) {
+        /* Needs clipping */
+        putGeneric(pos, value);
+        return;
+    }
+
+    float weightsX[N], weightsY[N];
+    for (int i = 0; i < N; ++i) {
+        weightsX[i] = m_filter[std::min((int) (std::abs(x0 + i - pos.x()) * m_lookupFactor),
+                                        NORI_FILTER_RESOLUTION)];
+        weightsY[i] = m_filter[std::min((int) (std::abs(y0 + i - pos.y()) * m_lookupFactor),
+                                        NORI_FILTER_RESOLUTION)];
+    }
+
+    /* The filter is separable: scale the value once per row */
+    Color4f color(value);
+    for (int y = 0; y < N; ++y) {
+        Color4f rowValue = color * weightsY[y];
+        Color4f *target = &coeffRef(y0 + y, x0);
+        for (int x = 0; x < N; ++x)
+            target[x] += rowValue * weightsX[x];
+    }
+}
+
+void ImageBlock::putGeneric(const Point2f &pos, const Color3f &value) {
     /* Compute the rectangle of pixels that will need to be updated */
     BoundingBox2i bbox(
         Point2i((int)  std::ceil(pos.x() - m_filterRadius), (int)  std::ceil(pos.y() - m_filterRadius)),
@@ -107,10 +248,59 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    if (!m_rowLocks) {
+        tbb::mutex::scoped_lock lock(m_mutex);
+
+        block(offset.y(), offset.x(), size.y(), size.x()) 
+            += b.topLeftCorner(size.y(), size.x());
+        return;
+    }
+
+    /* The blocks around this one write up to twice the border size
+       into it. All other pixels belong to this block alone */
+    int shared = 2 * b.getBorderSize();
+    bool interiorColumns = size.x() > 2 * shared;
+    for (int y = 0; y < size.y(); ++y) {
+        auto target = row(offset.y() + y).segment(offset.x(), size.x());
+        auto source = b.row(y).head(size.x());
+
+        if (y < shared || y >= size.y() - shared || !interiorColumns) {
+            tbb::spin_mutex::scoped_lock lock(m_rowLocks[offset.y() + y]);
+            target += source;
+        } else {
+            if (shared > 0) {
+                tbb::spin_mutex::scoped_lock lock(m_rowLocks[offset.y() + y]);
+                target.head(shared) += source.head(shared);
+                target.tail(shared) += source.tail(shared);
+            }
+            target.segment(shared, size.x() - 2 * shared) +=
+                source.segment(shared, size.x() - 2 * shared);
+        }
+    }
+}
+
+void ImageBlock::setRowLocking(bool enabled) {
+    if (enabled)
+        m_rowLocks.reset(new tbb::spin_mutex[rows()]);
+    else
+        m_rowLocks.reset();
+}
+
+void ImageBlock::snapshot(Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> &target) const {
+    target.resize(m_size.y(), m_size.x());
+    if (!m_rowLocks) {
+        tbb::mutex::scoped_lock lock(m_mutex);
+        target = block(m_borderSize, m_borderSize, m_size.y(), m_size.x());
+        return;
+    }
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+    /* Pixels that are only written by a single block are updated without
+       locking, hence a row may show a partially merged block. That only
+       lasts until the next snapshot */
+    for (int y = 0; y < m_size.y(); ++y) {
+        tbb::spin_mutex::scoped_lock lock(m_rowLocks[y + m_borderSize]);
+        target.row(y) = row(y + m_borderSize).segment(m_borderSize, m_size.x());
+    }
 }
 
 std::string ImageBlock::toString() const {
@@ -118,49 +308,70 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
-    m_numBlocks = Vector2i(
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, int splitCount,
+                               const Point2i &offset)
+        : m_next(0) {
+    Vector2i numBlocks(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
-}
-
-bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
+    int blockCount = numBlocks.x() * numBlocks.y();
 
-    if (m_blocksLeft == 0)
-        return false;
-
-    Point2i pos = m_block * m_blockSize;
-    block.setOffset(pos);
-    block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+    /* Walk the spiral starting at the center, skipping positions outside the image */
+    Point2i block(numBlocks / 2);
+    int direction = ERight, numSteps = 1, stepsLeft = 1;
+    std::vector<Point2i> order;
+    order.reserve(blockCount);
+    while ((int) order.size() < blockCount) {
+        if ((block.array() >= 0).all() && (block.array() < numBlocks.array()).all())
+            order.push_back(block);
 
-    if (--m_blocksLeft == 0)
-        return true;
+        switch (direction) {
+            case ERight: ++block.x(); break;
+            case EDown:  ++block.y(); break;
+            case ELeft:  --block.x(); break;
+            case EUp:    --block.y(); break;
+        }
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
+        if (--stepsLeft == 0) {
+            direction = (direction + 1) % 4;
+            if (direction == ELeft || direction == ERight)
+                ++numSteps;
+            stepsLeft = numSteps;
         }
+    }
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+    /* Convert into pixel regions, splitting the blocks at the end */
+    int halfSize = blockSize / 2;
+    int firstSplit = halfSize > 0 ? blockCount - std::min(splitCount, blockCount) : blockCount;
+    m_blocks.reserve(blockCount + 3 * (blockCount - firstSplit));
+    for (int i = 0; i < blockCount; ++i) {
+        Point2i pos = order[i] * blockSize;
+        Vector2i blockExtent = (size - pos).cwiseMin(Vector2i::Constant(blockSize));
+        Point2i imagePos = pos + offset;
+        if (i < firstSplit) {
+            m_blocks.push_back(Block { imagePos, blockExtent });
+            continue;
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+        for (int j = 0; j < 4; ++j) {
+            Vector2i subOffset(j % 2 * halfSize, j / 2 * halfSize);
+            Vector2i subSize = (blockExtent - subOffset).cwiseMin(Vector2i::Constant(halfSize));
+            if ((subSize.array() > 0).all())
+                m_blocks.push_back(Block { imagePos + subOffset, subSize });
+        }
+    }
+}
 
+bool BlockGenerator::next(ImageBlock &block) {
+    int index = m_next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= (int) m_blocks.size())
+        return false;
+    getBlock(index, block);
     return true;
 }
 
+void BlockGenerator::getBlock(int index, ImageBlock &block) const {
+    block.setOffset(m_blocks[index].offset);
+    block.setSize(m_blocks[index].size);
+}
+
 NORI_NAMESPACE_END
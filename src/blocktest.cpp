@@ -0,0 +1,145 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/rfilter.h>
+#include <pcg32.h>
+#include <memory>
+
+using namespace nori;
+
+/// Gives the tests access to the generic splatting code of \ref ImageBlock
+class TestBlock : public ImageBlock {
+public:
+    using ImageBlock::ImageBlock;
+
+    /// Record a sample through the generic path (same arguments as \ref put())
+    void putGeneric(const Point2f &pos, const Color3f &value) {
+        ImageBlock::putGeneric(Point2f(
+            pos.x() - 0.5f - (m_offset.x() - m_borderSize),
+            pos.y() - 0.5f - (m_offset.y() - m_borderSize)), value);
+    }
+};
+
+static ReconstructionFilter *createFilter(const std::string &name, float radius = 0) {
+    PropertyList props;
+    if (radius > 0)
+        props.setFloat("radius", radius);
+    return static_cast<ReconstructionFilter *>(NoriObjectFactory::createInstance(name, props));
+}
+
+/**
+ * Check that every sample recorded through the box filter updates exactly
+ * one pixel (the one containing it) with unit weight. This covers samples
+ * on pixel boundaries and in the last row and column of a block.
+ */
+static bool testBoxFilter(const ReconstructionFilter *filter, const Point2i &offset) {
+    const Vector2i size(8, 6);
+    ImageBlock block(size, filter);
+    block.setOffset(offset);
+    block.clear();
+
+    pcg32 rng;
+    std::vector<Point2f> positions;
+    for (int i = 0; i < 1000; ++i)
+        positions.push_back(offset.cast<float>() + Point2f(
+            rng.nextFloat() * size.x(), rng.nextFloat() * size.y()));
+    for (int y = 0; y < size.y(); ++y)
+        for (int x = 0; x < size.x(); ++x)
+            positions.push_back((offset + Point2i(x, y)).cast<float>());
+    positions.push_back((offset + size).cast<float>() - Point2f(1e-4f, 1e-4f));
+
+    for (const Point2f &pos : positions) {
+        Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> before = block;
+        block.put(pos, Color3f(1.0f, 2.0f, 3.0f));
+
+        Point2i expected = pos.cast<int>() - offset + Point2i::Constant(block.getBorderSize());
+        for (int y = 0; y < block.rows(); ++y) {
+            for (int x = 0; x < block.cols(); ++x) {
+                Color4f delta = block.coeff(y, x) - before.coeff(y, x);
+                Color4f target = (x == expected.x() && y == expected.y())
+                    ? Color4f(1.0f, 2.0f, 3.0f, 1.0f) : Color4f(0.0f, 0.0f, 0.0f, 0.0f);
+                if ((delta != target).any()) {
+                    cerr << "Sample at " << pos.toString() << " changed pixel ("
+                         << x << ", " << y << ") by " << delta.toString()
+                         << ", expected " << target.toString() << endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Check that \ref ImageBlock::put() (which uses the fixed-size windows for
+ * filters covering at most 5x5 pixels) splats samples with the same
+ * weights as the generic path.
+ */
+static bool testFixedWindow(const ReconstructionFilter *filter) {
+    const Vector2i size(16, 12);
+    const Point2i offset(32, 16);
+    TestBlock fixed(size, filter), generic(size, filter);
+    fixed.setOffset(offset);
+    generic.setOffset(offset);
+    fixed.clear();
+    generic.clear();
+
+    pcg32 rng;
+    for (int i = 0; i < 10000; ++i) {
+        Point2f pos = offset.cast<float>() + Point2f(
+            rng.nextFloat() * size.x(), rng.nextFloat() * size.y());
+        Color3f value(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        fixed.put(pos, value);
+        generic.putGeneric(pos, value);
+    }
+
+    for (int y = 0; y < fixed.rows(); ++y) {
+        for (int x = 0; x < fixed.cols(); ++x) {
+            const Color4f &c1 = fixed.coeff(y, x), &c2 = generic.coeff(y, x);
+            float error = (c1 - c2).abs().maxCoeff() / std::max(1.0f, c2.abs().maxCoeff());
+            if (!(error < 1e-5f)) {
+                cerr << filter->toString() << ": pixel (" << x << ", " << y << ") is "
+                     << c1.toString() << ", expected " << c2.toString() << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    std::unique_ptr<ReconstructionFilter> box(createFilter("box"));
+    bool success = testBoxFilter(box.get(), Point2i(0, 0)) &&
+                   testBoxFilter(box.get(), Point2i(32, 16));
+
+    /* Window sizes from 1x1 (narrow gaussian) to 5x5 */
+    std::unique_ptr<ReconstructionFilter> filters[] = {
+        std::unique_ptr<ReconstructionFilter>(createFilter("gaussian", 0.4f)),
+        std::unique_ptr<ReconstructionFilter>(createFilter("gaussian", 0.5f)),
+        std::unique_ptr<ReconstructionFilter>(createFilter("tent")),
+        std::unique_ptr<ReconstructionFilter>(createFilter("gaussian", 1.5f)),
+        std::unique_ptr<ReconstructionFilter>(createFilter("gaussian")),
+        std::unique_ptr<ReconstructionFilter>(createFilter("mitchell"))
+    };
+    for (const auto &filter : filters)
+        success &= testFixedWindow(filter.get());
+
+    cout << (success ? "Passed" : "Failed") << endl;
+    return success ? 0 : 1;
+}
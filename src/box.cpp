@@ -10,6 +10,7 @@ public:
     // Axis-aligned unit cube by default [-1,1] in each axis
     m_min = Point3f(-1.f, -1.f, -1.f);
     m_max = Point3f( 1.f,  1.f,  1.f);
+    m_bbox = BoundingBox3f(m_min, m_max);
   }
 
   void activate() {
@@ -65,6 +66,8 @@ public:
     return true;
 }
 
+  const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
   /// Register a child object (e.g. a BSDF) with the mesh
   void addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
@@ -112,6 +115,7 @@ private:
 
 private:
   Point3f m_min, m_max; 
+  BoundingBox3f m_bbox;
   BSDF *m_bsdf = nullptr;       ///< BSDF of the surface
   Emitter *m_emitter = nullptr; ///< Associated emitter, if any
 };
@@ -0,0 +1,219 @@
+#include <nori/cache.h>
+#include <filesystem/path.h>
+#include <cstdio>
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#  include <direct.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/* Cache files start with this magic number, followed by the format
+   version. Bump the version whenever the layout of a cached structure
+   (e.g. Accel::BVHNode) changes */
+static const char CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'C', 'A', 'C', 'H' };
+static const uint32_t CACHE_VERSION = 1;
+
+/* Arrays are aligned to this many bytes within the file */
+static const size_t CACHE_ALIGNMENT = 16;
+
+/* Padding after an array of \c size bytes (including its size prefix) */
+static size_t cachePadding(size_t size) {
+    return (CACHE_ALIGNMENT - (sizeof(uint64_t) + size) % CACHE_ALIGNMENT) % CACHE_ALIGNMENT;
+}
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key;
+};
+
+static std::string &cacheDirectory() {
+    static std::string directory;
+    return directory;
+}
+
+void setCacheDirectory(const std::string &path) {
+    if (!path.empty() && !filesystem::path(path).is_directory()) {
+#if defined(_WIN32)
+        int result = _mkdir(path.c_str());
+#else
+        int result = mkdir(path.c_str(), 0755);
+#endif
+        if (result != 0)
+            throw NoriException("Unable to create the cache directory \"%s\"!", path);
+    }
+    cacheDirectory() = path;
+}
+
+const std::string &getCacheDirectory() {
+    return cacheDirectory();
+}
+
+std::string getCacheFilename(const std::string &prefix, uint64_t key) {
+    return (filesystem::path(getCacheDirectory()) /
+            filesystem::path(tfm::format("%s-%016x.bin", prefix, key))).str();
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *ptr = (const uint8_t *) data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= ptr[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+MappedFile::MappedFile(const std::string &filename) {
+#if defined(_WIN32)
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        throw NoriException("Unable to open \"%s\"!", filename);
+    LARGE_INTEGER size;
+    GetFileSizeEx(m_file, &size);
+    m_size = (size_t) size.QuadPart;
+    if (m_size > 0) {
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping)
+            throw NoriException("Unable to map \"%s\" into memory!", filename);
+        m_data = (const uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!m_data)
+            throw NoriException("Unable to map \"%s\" into memory!", filename);
+    }
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw NoriException("Unable to open \"%s\"!", filename);
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        throw NoriException("Unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) sb.st_size;
+    if (m_size > 0) {
+        void *ptr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw NoriException("Unable to map \"%s\" into memory!", filename);
+        }
+        m_data = (const uint8_t *) ptr;
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if defined(_WIN32)
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file && m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+#else
+    if (m_data)
+        munmap((void *) m_data, m_size);
+#endif
+}
+
+CacheWriter::CacheWriter(const std::string &filename, uint64_t key)
+    : m_filename(filename) {
+    m_file = fopen((m_filename + ".tmp").c_str(), "wb");
+    if (!m_file) {
+        m_failed = true;
+        return;
+    }
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.reserved = 0;
+    header.key = key;
+    m_failed = fwrite(&header, sizeof(header), 1, m_file) != 1;
+}
+
+CacheWriter::~CacheWriter() {
+    if (m_file) {
+        fclose(m_file);
+        std::remove((m_filename + ".tmp").c_str());
+    }
+}
+
+void CacheWriter::write(const void *data, size_t size) {
+    if (m_failed)
+        return;
+    static const uint8_t zeros[CACHE_ALIGNMENT] = { 0 };
+    uint64_t size64 = (uint64_t) size;
+    size_t padding = cachePadding(size);
+    m_failed = fwrite(&size64, sizeof(size64), 1, m_file) != 1 ||
+        (size > 0 && fwrite(data, size, 1, m_file) != 1) ||
+        (padding > 0 && fwrite(zeros, padding, 1, m_file) != 1);
+}
+
+bool CacheWriter::commit() {
+    if (!m_file)
+        return false;
+    m_failed |= fclose(m_file) != 0;
+    m_file = nullptr;
+
+    std::string tmpName = m_filename + ".tmp";
+    if (!m_failed) {
+        /* rename() doesn't replace existing files on Windows */
+        std::remove(m_filename.c_str());
+        m_failed = std::rename(tmpName.c_str(), m_filename.c_str()) != 0;
+    }
+    if (m_failed)
+        std::remove(tmpName.c_str());
+    return !m_failed;
+}
+
+CacheReader::CacheReader(const std::string &filename, uint64_t key) {
+    if (!filesystem::path(filename).is_file())
+        return;
+
+    try {
+        m_file = new MappedFile(filename);
+    } catch (const NoriException &) {
+        return;
+    }
+
+    const CacheHeader *header = (const CacheHeader *) m_file->data();
+    if (m_file->size() < sizeof(CacheHeader) ||
+        memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header->version != CACHE_VERSION || header->key != key) {
+        delete m_file;
+        m_file = nullptr;
+        return;
+    }
+    m_pos = sizeof(CacheHeader);
+}
+
+CacheReader::~CacheReader() {
+    delete m_file;
+}
+
+const uint8_t *CacheReader::read(size_t &size) {
+    if (!m_file || m_pos + sizeof(uint64_t) > m_file->size())
+        throw NoriException("CacheReader: unexpected end of file!");
+    uint64_t size64;
+    memcpy(&size64, m_file->data() + m_pos, sizeof(uint64_t));
+    if (size64 > m_file->size() - m_pos - sizeof(uint64_t))
+        throw NoriException("CacheReader: unexpected end of file!");
+    size = (size_t) size64;
+
+    const uint8_t *data = m_file->data() + m_pos + sizeof(uint64_t);
+    m_pos += sizeof(uint64_t) + size + cachePadding(size);
+    return data;
+}
+
+NORI_NAMESPACE_END
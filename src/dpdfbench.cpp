@@ -0,0 +1,97 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/dpdf.h>
+#include <nori/timer.h>
+#include <pcg32.h>
+
+using namespace nori;
+
+/* Keeps the compiler from optimizing the lookups away */
+static volatile size_t sink;
+
+/* Minimum duration of a measurement in milliseconds, far above the
+   resolution of the timer */
+static const double MinTime = 250.0;
+
+/**
+ * Transform all samples with \c lookup, repeating the pass until at least
+ * \ref MinTime has elapsed. Returns the average time per sample in ns.
+ */
+template <typename Lookup> static double timeLookups(const std::vector<float> &samples,
+                                                     const Lookup &lookup) {
+    Timer timer;
+    size_t passes = 0, sum = 0;
+    double elapsed;
+    do {
+        for (float sample : samples)
+            sum += lookup(sample);
+        ++passes;
+        elapsed = timer.elapsed();
+    } while (elapsed < MinTime);
+    sink = sum;
+    return 1e6 * elapsed / ((double) passes * samples.size());
+}
+
+/**
+ * Microbenchmark of the two sampling methods of \ref DiscretePDF: the
+ * binary search over the CDF and the alias table. Both transform the
+ * same precomputed uniform samples, so that only the lookup is timed.
+ *
+ * Usage: dpdfbench [sample count]
+ */
+int main(int argc, char **argv) {
+    size_t sampleCount = argc > 1 ? (size_t) std::stoull(argv[1]) : 1000000;
+    if (sampleCount == 0) {
+        cerr << "Sample count must be positive" << endl;
+        return -1;
+    }
+
+    pcg32 rng;
+    std::vector<float> samples(sampleCount);
+    for (float &sample : samples)
+        sample = rng.nextFloat();
+
+    cout << "Transforming " << sampleCount << " samples (repeated for at least "
+         << MinTime << " ms per method):" << endl;
+    for (size_t entries : { 1000, 10000, 100000, 1000000, 10000000 }) {
+        /* Strongly varying weights, like the triangle areas of a mesh */
+        DiscretePDF pdf(entries);
+        for (size_t i = 0; i < entries; ++i) {
+            float x = rng.nextFloat();
+            pdf.append(x * x * x + 1e-3f);
+        }
+
+        Timer timer;
+        pdf.normalize();
+        double buildTime = timer.lap();
+
+        double cdfTime = timeLookups(samples,
+            [&pdf](float sample) { return pdf.sample(sample); });
+        double aliasTime = timeLookups(samples,
+            [&pdf](float sample) { return pdf.sampleAlias(sample); });
+
+        cout << tfm::format("  %8i entries: build %6.1f ms, cdf %6.2f ns/sample, "
+            "alias %6.2f ns/sample", entries, buildTime, cdfTime, aliasTime);
+        if (aliasTime > 0)
+            cout << tfm::format(", speedup %4.1fx", cdfTime / aliasTime);
+        cout << endl;
+    }
+
+    return 0;
+}
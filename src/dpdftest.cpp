@@ -0,0 +1,125 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/dpdf.h>
+#include <pcg32.h>
+
+using namespace nori;
+
+/* Number of samples drawn from every distribution */
+static const size_t SampleCount = 1000000;
+
+/* Number of histogram bins of the reused sample */
+static const size_t ReuseBins = 10;
+
+/// Is \c count consistent with \c n Bernoulli trials of probability \c p?
+static bool checkCount(size_t count, size_t n, double p) {
+    double mean = n * p, stddev = std::sqrt(n * p * (1 - p));
+    return std::abs((double) count - mean) <= 5 * stddev + 1;
+}
+
+/**
+ * Draw samples from the alias table of \c pdf and check that
+ *  - the frequency of every entry matches its probability,
+ *  - entries with zero weight are never returned, not even for samples
+ *    on the boundaries of the table columns,
+ *  - \ref DiscretePDF::sampleAliasReuse() returns the same entry as
+ *    \ref DiscretePDF::sampleAlias(), with a reused sample that is
+ *    uniformly distributed on [0, 1] for every returned entry.
+ */
+static bool testAlias(const std::string &name, const std::vector<float> &weights) {
+    DiscretePDF pdf(weights.size());
+    for (float weight : weights)
+        pdf.append(weight);
+    pdf.normalize();
+
+    size_t n = pdf.size();
+    std::vector<size_t> counts(n, 0);
+    std::vector<std::vector<size_t>> reuseCounts(n, std::vector<size_t>(ReuseBins, 0));
+
+    pcg32 rng;
+    std::vector<float> samples;
+    for (size_t i = 0; i < SampleCount; ++i)
+        samples.push_back(rng.nextFloat());
+
+    for (float sample : samples) {
+        float reused = sample, samplePdf;
+        size_t index = pdf.sampleAlias(sample, samplePdf);
+        if (index >= n || samplePdf != pdf[index]) {
+            cerr << name << ": sample " << sample << " returned entry " << index
+                 << " with pdf " << samplePdf << endl;
+            return false;
+        }
+        if (pdf.sampleAliasReuse(reused) != index || !(reused >= 0 && reused <= 1)) {
+            cerr << name << ": sample " << sample << " was reused as " << reused
+                 << " for entry " << index << endl;
+            return false;
+        }
+        ++counts[index];
+        ++reuseCounts[index][std::min((size_t) (reused * ReuseBins), ReuseBins - 1)];
+    }
+
+    /* Samples on and next to the column boundaries of the table */
+    for (size_t i = 0; i <= n; ++i) {
+        float boundary = (float) i / n;
+        for (float sample : { boundary, std::nextafter(boundary, 0.0f),
+                              std::nextafter(boundary, 1.0f) }) {
+            if (sample < 0 || sample > 1)
+                continue;
+            size_t index = pdf.sampleAlias(sample);
+            if (index >= n || pdf[index] == 0) {
+                cerr << name << ": boundary sample " << sample
+                     << " returned entry " << index << endl;
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (pdf[i] == 0 ? counts[i] != 0 : !checkCount(counts[i], SampleCount, pdf[i])) {
+            cerr << name << ": entry " << i << " was sampled " << counts[i]
+                 << " times, expected " << SampleCount * pdf[i] << endl;
+            return false;
+        }
+        for (size_t bin = 0; bin < ReuseBins; ++bin) {
+            if (!checkCount(reuseCounts[i][bin], counts[i], 1.0 / ReuseBins)) {
+                cerr << name << ": entry " << i << " has " << reuseCounts[i][bin]
+                     << " reused samples in bin " << bin << ", expected "
+                     << (double) counts[i] / ReuseBins << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool success = true;
+    success &= testAlias("uniform", { 1, 1, 1, 1, 1 });
+    success &= testAlias("zeros", { 0, 1, 0, 3, 0.5f, 0, 2, 0 });
+    success &= testAlias("single", { 0, 0, 5, 0 });
+    success &= testAlias("skewed", { 1e-4f, 1, 1e-3f, 100, 0.1f, 0, 10 });
+
+    std::vector<float> ramp;
+    for (int i = 0; i < 1000; ++i)
+        ramp.push_back(i % 7 == 0 ? 0.0f : (float) i);
+    success &= testAlias("ramp", ramp);
+
+    cout << (success ? "Passed" : "Failed") << endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include <nori/accel.h>
+#include <nori/tlas.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Collection of shapes with its own acceleration structures
+ *
+ * Meshes of the group are stored in a dedicated triangle BVH (which
+ * accepts the same \c bvh* parameters as the scene), and all members are
+ * combined by a \ref TopLevelAccel.
+ *
+ * A group with an \c id is a prototype: it is not rendered by itself, but
+ * any number of instances can refer to it (<tt>\<string name="ref"
+ * value=".."/\></tt>). The geometry and its BVH then exist only once, no
+ * matter how often it is instantiated.
+ */
+class Group : public Shape {
+public:
+    Group(const PropertyList &props) {
+        m_name = props.getString("id", "");
+        m_accel = new Accel(props);
+    }
+
+    virtual ~Group() {
+        delete m_accel;
+    }
+
+    void activate() {
+        if (m_accel->getMeshCount() > 0) {
+            m_accel->activate();
+            m_shapes.push_back(m_accel);
+        }
+
+        /* The group is unbounded if any of its members is */
+        bool bounded = true;
+        for (const Shape *shape : m_shapes) {
+            if (shape->getBoundingBox().isValid())
+                m_bbox.expandBy(shape->getBoundingBox());
+            else
+                bounded = false;
+        }
+        if (!bounded)
+            m_bbox.reset();
+
+        m_tlas.build(m_shapes);
+    }
+
+    bool isPrototype() const { return !m_name.empty(); }
+
+    const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+    bool rayIntersect(Ray3f &ray, Intersection &its,
+                      bool shadowRay = false) const {
+        return m_tlas.rayIntersect(ray, its, shadowRay);
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EMesh: {
+                    Mesh *mesh = static_cast<Mesh *>(obj);
+                    /* Emitter sampling only knows about the scene's meshes */
+                    if (mesh->isEmitter())
+                        throw NoriException("Group: emitters are not supported "
+                            "within groups (\"%s\")!", mesh->getName());
+                    m_accel->addMesh(mesh);
+                }
+                break;
+
+            case EShape:
+                m_shapes.push_back(static_cast<Shape *>(obj));
+                break;
+
+            default:
+                throw NoriException("Group::addChild(<%s>) is not supported!",
+                                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "Group[\n"
+            "  id = \"%s\",\n"
+            "  shapes = %i,\n"
+            "  accel = %s\n"
+            "]",
+            m_name,
+            m_shapes.size(),
+            indent(m_accel->toString())
+        );
+    }
+
+private:
+    Accel *m_accel;                 ///< Triangle BVH over the meshes of the group
+    std::vector<Shape *> m_shapes;  ///< All members (including the triangle BVH)
+    TopLevelAccel m_tlas;           ///< Hierarchy over all members
+    BoundingBox3f m_bbox;           ///< Bounds of the group
+};
+
+NORI_REGISTER_CLASS(Group, "group");
+NORI_NAMESPACE_END
@@ -92,18 +92,14 @@ NoriScreen::~NoriScreen() {
 }
 
 void NoriScreen::drawContents() {
-    /* Reload the partially rendered image onto the GPU */
-    m_block.lock();
-    int borderSize = m_block.getBorderSize();
+    /* Reload the partially rendered image onto the GPU. The upload reads a
+       copy, so that rendering threads aren't blocked in the meantime */
+    m_block.snapshot(m_snapshot);
     const Vector2i &size = m_block.getSize();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texture);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) m_block.cols());
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(),
-            0, GL_RGBA, GL_FLOAT, (uint8_t *) m_block.data() +
-            (borderSize * m_block.cols() + borderSize) * sizeof(Color4f));
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-    m_block.unlock();
+            0, GL_RGBA, GL_FLOAT, (uint8_t *) m_snapshot.data());
 
     glViewport(0, GLsizei(36 * mPixelRatio), GLsizei(mPixelRatio*size[0]),
          GLsizei(mPixelRatio*size[1]));
@@ -42,6 +42,8 @@ public:
         return intersectRecursive(ray, its, m_bounds, 0, shadowRay);
     }
 
+    const BoundingBox3f &getBoundingBox() const { return m_bounds; }
+
     void addChild(NoriObject *obj) {
         switch (obj->getClassType()) {
         case EBSDF:
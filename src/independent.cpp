@@ -34,6 +34,9 @@ class Independent : public Sampler {
 public:
     Independent(const PropertyList &propList) {
         m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_adaptiveThreshold = propList.getFloat("adaptiveThreshold", 0.f);
+        m_minSampleCount = std::min(m_sampleCount,
+            (size_t) propList.getInteger("minSampleCount", 16));
     }
 
     virtual ~Independent() { }
@@ -41,13 +44,15 @@ public:
     std::unique_ptr<Sampler> clone() const {
         std::unique_ptr<Independent> cloned(new Independent());
         cloned->m_sampleCount = m_sampleCount;
+        cloned->m_minSampleCount = m_minSampleCount;
+        cloned->m_adaptiveThreshold = m_adaptiveThreshold;
         cloned->m_random = m_random;
         return std::move(cloned);
     }
 
-    void prepare(const ImageBlock &block) {
+    void prepare(const ImageBlock &block, uint32_t pass) {
         m_random.seed(
-            block.getOffset().x(),
+            block.getOffset().x() + ((uint64_t) pass << 32),
             block.getOffset().y()
         );
     }
@@ -67,6 +72,10 @@ public:
     }
 
     std::string toString() const {
+        if (m_adaptiveThreshold > 0)
+            return tfm::format("Independent[sampleCount=%i, adaptiveThreshold=%f, "
+                               "minSampleCount=%i]", m_sampleCount,
+                               m_adaptiveThreshold, m_minSampleCount);
         return tfm::format("Independent[sampleCount=%i]", m_sampleCount);
     }
 protected:
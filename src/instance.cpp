@@ -10,27 +10,58 @@ public:
   Instance(const PropertyList &props) {
     // Get transform
     m_transform = props.getTransform("toWorld");
+    m_toLocal = m_transform.inverse();
     //std::cout<<"Here\n"<<m_transform.toString();
+
+    // Identifier of a shared prototype (instead of a child shape)
+    m_ref = props.getString("ref", "");
   }
 
   void activate() {
+    if (!m_shape && m_ref.empty())
+      throw NoriException("Instance: requires a child shape or a \"ref\"!");
+    if (m_shape && !m_ref.empty())
+      throw NoriException("Instance: can't have both a child shape and a \"ref\"!");
+
     if (!m_shape) {
       /* If no material was assigned, instantiate a diffuse BRDF */
       m_bsdf = static_cast<BSDF *>(
           NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
+
+    updateBounds();
+  }
+
+  void setParent(NoriObject *parent) {
+    /* Prototypes are only resolved among the children of the scene */
+    if (!m_ref.empty() && parent->getClassType() != EScene)
+      throw NoriException("Instance: references to prototypes (\"%s\") are "
+                          "only supported at the top level of the scene!", m_ref);
+  }
+
+  void resolveReferences(const std::map<std::string, Shape *> &prototypes) {
+    if (m_ref.empty())
+      return;
+    auto it = prototypes.find(m_ref);
+    if (it == prototypes.end())
+      throw NoriException("Instance: unknown prototype \"%s\"!", m_ref);
+    m_shape = it->second;
+    updateBounds();
   }
 
+  const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
   bool rayIntersect(Ray3f &ray, Intersection &its,
                     bool shadowRay = false) const {
     // Inverse ray and call rayIntersect of child objects
-    Ray3f localRay = m_transform.inverse()*ray;
+    Ray3f localRay = m_toLocal*ray;
     bool hit = m_shape->rayIntersect(localRay, its, shadowRay);
-    if (hit) {
-        // Transform intersection data back to world space
+    if (hit && !shadowRay) {
+        // Transform intersection data back to world space. The ray
+        // parameterization is preserved, so its.t remains valid.
         its.p = m_transform*its.p;
-        its.shFrame.n = m_transform*its.shFrame.n;
-        //its.geoFrame.n = m_transform*its.geoFrame.n;
+        its.shFrame = Frame((m_transform*its.shFrame.n).normalized());
+        its.geoFrame = Frame((m_transform*its.geoFrame.n).normalized());
         ray.maxt = localRay.maxt;
     }
     return hit;
@@ -55,16 +86,32 @@ public:
   std::string toString() const {
     return tfm::format(
         "Instance[\n"
+        "ref = \"%s\"\n"
         "emitter = %s\n"
         "bsdf = %s\n"
         "]",
+        m_ref,
         (m_emitter) ? indent(m_emitter->toString()) : std::string("null"),
         (m_bsdf) ? indent(m_bsdf->toString()) : std::string("null"));
   }
 
+private:
+  /// Compute the world space bounds of the transformed shape (unless it is unbounded)
+  void updateBounds() {
+    m_bbox.reset();
+    if (m_shape && m_shape->getBoundingBox().isValid()) {
+      const BoundingBox3f &bbox = m_shape->getBoundingBox();
+      for (int i = 0; i < 8; ++i)
+        m_bbox.expandBy(m_transform * bbox.getCorner(i));
+    }
+  }
+
 private:
   Transform m_transform;
-  Shape *m_shape = nullptr;
+  Transform m_toLocal;          ///< Cached inverse of \c m_transform
+  std::string m_ref;            ///< Identifier of the referenced prototype, if any
+  BoundingBox3f m_bbox;         ///< World space bounds
+  Shape *m_shape = nullptr;     ///< Instanced shape (owned by the prototype if shared)
   BSDF *m_bsdf = nullptr;       ///< BSDF of the surface
   Emitter *m_emitter = nullptr; ///< Associated emitter, if any
 };
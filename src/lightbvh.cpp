@@ -0,0 +1,203 @@
+#include <nori/lightbvh.h>
+#include <Eigen/Geometry>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/* Largest float below one, keeps rescaled samples in [0,1) */
+static const float OneMinusEpsilon = 0.99999994f;
+
+static float safeAcos(float value) {
+    return std::acos(std::min(1.0f, std::max(-1.0f, value)));
+}
+
+/// Compute a cone that contains the cones <tt>(axisA, cosA)</tt> and <tt>(axisB, cosB)</tt>
+static float coneUnion(const Vector3f &axisA, float cosA,
+                       const Vector3f &axisB, float cosB, Vector3f &axis) {
+    float thetaA = safeAcos(cosA), thetaB = safeAcos(cosB);
+    float thetaD = safeAcos(axisA.dot(axisB));
+
+    /* One of the cones contains the other one */
+    if (std::min(thetaD + thetaB, M_PI) <= thetaA) {
+        axis = axisA;
+        return cosA;
+    }
+    if (std::min(thetaD + thetaA, M_PI) <= thetaB) {
+        axis = axisB;
+        return cosB;
+    }
+
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    Vector3f rotationAxis = axisA.cross(axisB);
+    if (thetaO >= M_PI || rotationAxis.squaredNorm() == 0.0f) {
+        axis = axisA;
+        return -1.0f;
+    }
+
+    /* Rotate the axis of A towards B, so that the new cone just contains A */
+    float thetaR = thetaO - thetaA;
+    rotationAxis.normalize();
+    axis = (axisA * std::cos(thetaR) +
+            rotationAxis.cross(axisA) * std::sin(thetaR)).normalized();
+    return std::cos(thetaO);
+}
+
+void LightBVH::build(const std::vector<const Emitter *> &emitters,
+                     const std::vector<float> &power) {
+    clear();
+    if (emitters.empty())
+        return;
+
+    std::vector<Node> lights(emitters.size());
+    for (uint32_t i = 0; i < (uint32_t) emitters.size(); ++i) {
+        Node &light = lights[i];
+        light.bbox = emitters[i]->getBoundingBox();
+        light.cosTheta = emitters[i]->getEmissionCone(light.axis);
+        light.power = power[i];
+        light.index = i;
+        light.leaf = true;
+    }
+
+    m_path.resize(emitters.size());
+    m_depth.resize(emitters.size());
+
+    /* A binary tree over n emitters has 2n-1 nodes */
+    m_nodes.reserve(2 * emitters.size() - 1);
+    m_nodes.emplace_back();
+    buildRecursive(lights, 0, 0, (uint32_t) lights.size(), 0, 0);
+}
+
+void LightBVH::clear() {
+    m_nodes.clear();
+    m_path.clear();
+    m_depth.clear();
+}
+
+void LightBVH::buildRecursive(std::vector<Node> &lights, uint32_t nodeIdx, uint32_t start,
+                              uint32_t end, uint32_t depth, uint64_t path) {
+    if (end - start == 1) {
+        m_nodes[nodeIdx] = lights[start];
+        m_path[lights[start].index] = path;
+        m_depth[lights[start].index] = (uint8_t) depth;
+        return;
+    }
+
+    /* Split at the median along the largest axis of the centroids. Each
+       split halves the emitters, so this is never reached in practice */
+    if (depth >= MaxDepth)
+        throw NoriException("LightBVH: exceeded the maximum depth of %i!", (int) MaxDepth);
+
+    BoundingBox3f centroids;
+    for (uint32_t i = start; i < end; ++i)
+        centroids.expandBy(lights[i].bbox.getCenter());
+    int axis = centroids.getLargestAxis();
+    uint32_t mid = start + (end - start) / 2;
+    std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end,
+        [axis](const Node &n1, const Node &n2) {
+            return n1.bbox.getCenter()[axis] < n2.bbox.getCenter()[axis];
+        });
+
+    uint32_t left = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes.emplace_back();
+    buildRecursive(lights, left, start, mid, depth + 1, path);
+    buildRecursive(lights, left + 1, mid, end, depth + 1, path | (1ull << depth));
+
+    const Node &n1 = m_nodes[left], &n2 = m_nodes[left + 1];
+    Node &node = m_nodes[nodeIdx];
+    node.bbox = n1.bbox;
+    node.bbox.expandBy(n2.bbox);
+    node.cosTheta = coneUnion(n1.axis, n1.cosTheta, n2.axis, n2.cosTheta, node.axis);
+    node.power = n1.power + n2.power;
+    node.index = left;
+    node.leaf = false;
+}
+
+float LightBVH::importance(const Node &node, const Point3f &ref) {
+    /* Distance to the center, clamped to the radius of the bounding sphere
+       so that the estimate doesn't diverge close to the emitters */
+    Vector3f d = ref - node.bbox.getCenter();
+    float dist2 = d.squaredNorm();
+    float radius2 = 0.25f * node.bbox.getExtents().squaredNorm();
+    if (dist2 <= radius2)
+        return node.power / std::max(radius2, Epsilon);
+
+    /* Smallest angle between the emission cone and the directions from the
+       bounds towards the point. Beyond 90 degrees, nothing reaches it */
+    float thetaW = safeAcos(node.axis.dot(d) / std::sqrt(dist2));
+    float thetaO = safeAcos(node.cosTheta);
+    float thetaB = std::asin(std::sqrt(radius2 / dist2));
+    float theta = std::max(0.0f, thetaW - thetaO - thetaB);
+    if (theta >= 0.5f * M_PI)
+        return 0.0f;
+
+    return node.power * std::cos(theta) / dist2;
+}
+
+int LightBVH::sample(const Point3f &ref, float sample, float &pdf) const {
+    pdf = 0.0f;
+    if (m_nodes.empty())
+        return -1;
+
+    float prob = 1.0f;
+    uint32_t nodeIdx = 0;
+    while (!m_nodes[nodeIdx].leaf) {
+        uint32_t left = m_nodes[nodeIdx].index;
+        float importanceLeft = importance(m_nodes[left], ref);
+        float importanceRight = importance(m_nodes[left + 1], ref);
+        if (importanceLeft + importanceRight <= 0.0f)
+            return -1;
+
+        /* Choose a child and rescale the sample for the next decision */
+        float probLeft = importanceLeft / (importanceLeft + importanceRight);
+        if (sample < probLeft) {
+            sample = std::min(sample / probLeft, OneMinusEpsilon);
+            prob *= probLeft;
+            nodeIdx = left;
+        } else {
+            sample = std::min((sample - probLeft) / (1.0f - probLeft), OneMinusEpsilon);
+            prob *= 1.0f - probLeft;
+            nodeIdx = left + 1;
+        }
+    }
+
+    pdf = prob;
+    return (int) m_nodes[nodeIdx].index;
+}
+
+float LightBVH::pdf(const Point3f &ref, uint32_t index) const {
+    if (index >= m_path.size())
+        return 0.0f;
+
+    /* Replay the decisions of sample() along the path to the emitter */
+    float prob = 1.0f;
+    uint32_t nodeIdx = 0;
+    uint64_t path = m_path[index];
+    for (uint32_t depth = 0; depth < m_depth[index]; ++depth) {
+        uint32_t left = m_nodes[nodeIdx].index;
+        float importanceLeft = importance(m_nodes[left], ref);
+        float importanceRight = importance(m_nodes[left + 1], ref);
+        if (importanceLeft + importanceRight <= 0.0f)
+            return 0.0f;
+
+        float probLeft = importanceLeft / (importanceLeft + importanceRight);
+        if ((path >> depth) & 1) {
+            prob *= 1.0f - probLeft;
+            nodeIdx = left + 1;
+        } else {
+            prob *= probLeft;
+            nodeIdx = left;
+        }
+    }
+    return prob;
+}
+
+std::string LightBVH::toString() const {
+    uint32_t maxDepth = 0;
+    for (uint8_t depth : m_depth)
+        maxDepth = std::max(maxDepth, (uint32_t) depth);
+    return tfm::format("LightBVH[emitters=%i, nodes=%i, depth=%i]",
+        m_depth.size(), m_nodes.size(), maxDepth);
+}
+
+NORI_NAMESPACE_END
@@ -25,20 +25,161 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/cache.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
+#include <ImfInputFile.h>
 #include <thread>
 
 using namespace nori;
 
 static int threadCount = -1;
 static bool use_gui = true;
+static bool batchMode = false;          /* Render jobs read from stdin */
+static std::string cropWindow;          /* "x,y,width,height" (empty: camera setting) */
+static int samplesPerPass = 0;          /* Progressive rendering (0: disabled) */
+static double timeBudget = 0;           /* Wall-clock budget in seconds (0: none) */
+static double checkpointInterval = 0;   /* Seconds between checkpoints (0: none) */
+
+/**
+ * \brief Per-pixel statistics for adaptive sampling
+ *
+ * The image is rendered in passes. Every pixel first receives the minimum
+ * sample count of the sampler, and every following pass doubles the number
+ * of samples of the pixels that haven't converged yet. A pixel is converged
+ * once the relative standard error of its mean luminance falls below the
+ * threshold of the sampler, or once it reached the sample count. The time
+ * saved on smooth regions thus goes to the noisy ones.
+ *
+ * Each pixel is only updated by the thread rendering its block.
+ */
+class AdaptiveSampling {
+public:
+    AdaptiveSampling(const Point2i &offset, const Vector2i &size, const Sampler *sampler)
+        : m_offset(offset), m_size(size), m_pixels((size_t) size.x() * size.y()),
+          m_threshold(sampler->getAdaptiveThreshold()),
+          m_minSampleCount((uint32_t) sampler->getMinSampleCount()),
+          m_maxSampleCount((uint32_t) sampler->getSampleCount()) { }
+
+    /// Return the number of samples the given pixel receives in the next pass
+    uint32_t getSampleCount(const Point2i &pixel) const {
+        const Pixel &p = m_pixels[index(pixel)];
+        if (p.count < m_minSampleCount)
+            return m_minSampleCount - p.count;
+        if (p.count >= m_maxSampleCount || p.relativeError() < m_threshold)
+            return 0;
+        return std::min(p.count, m_maxSampleCount - p.count);
+    }
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
-    const Camera *camera = scene->getCamera();
+    /// Does any pixel of the block need samples in the next pass?
+    bool isActive(const ImageBlock &block) const {
+        Point2i offset = block.getOffset();
+        Vector2i size = block.getSize();
+        for (int y = 0; y < size.y(); ++y)
+            for (int x = 0; x < size.x(); ++x)
+                if (getSampleCount(offset + Vector2i(x, y)) > 0)
+                    return true;
+        return false;
+    }
+
+    /// Return the number of pixels that need samples in the next pass
+    size_t getActivePixelCount() const {
+        size_t count = 0;
+        for (int y = 0; y < m_size.y(); ++y)
+            for (int x = 0; x < m_size.x(); ++x)
+                count += getSampleCount(m_offset + Vector2i(x, y)) > 0 ? 1 : 0;
+        return count;
+    }
+
+    /// Return the average number of samples per pixel so far
+    float getAverageSampleCount() const {
+        double sum = 0;
+        for (const Pixel &p : m_pixels)
+            sum += p.count;
+        return (float) (sum / m_pixels.size());
+    }
+
+    /**
+     * \brief Record a sample of the given pixel
+     *
+     * Invalid values (NaN, infinity) count toward the sample budget, so that
+     * pixels where the integrator fails still finish, but they are left out
+     * of the error estimate.
+     */
+    void put(const Point2i &pixel, const Color3f &value) {
+        Pixel &p = m_pixels[index(pixel)];
+        ++p.count;
+        if (value.isValid())
+            p.add(value.getLuminance());
+    }
+
+private:
+    size_t index(const Point2i &pixel) const {
+        return (size_t) (pixel.y() - m_offset.y()) * m_size.x() + (pixel.x() - m_offset.x());
+    }
+
+    /// Running mean and variance of the valid samples (Welford's algorithm)
+    struct Pixel {
+        uint32_t count = 0;  ///< All samples taken so far
+        uint32_t valid = 0;  ///< Samples that entered the mean and variance
+        float mean = 0.f, m2 = 0.f;
+
+        void add(float value) {
+            float delta = value - mean;
+            mean += delta / ++valid;
+            m2 += delta * (value - mean);
+        }
+
+        /// Relative standard error of the mean (dark pixels need less accuracy)
+        float relativeError() const {
+            if (valid < 2)
+                return std::numeric_limits<float>::infinity();
+            float variance = m2 / (valid - 1);
+            return std::sqrt(variance / valid) / std::max(mean, 1e-2f);
+        }
+    };
+
+    Point2i m_offset;
+    Vector2i m_size;
+    std::vector<Pixel> m_pixels;
+    float m_threshold;
+    uint32_t m_minSampleCount, m_maxSampleCount;
+};
+
+/**
+ * \brief Per-thread rendering state
+ *
+ * Each worker thread creates its context when it renders its first block
+ * of a job and reuses it for all following blocks and passes, so that the
+ * render loop itself doesn't allocate any memory.
+ */
+struct RenderContext {
+    RenderContext(const Camera *camera, const Sampler *sampler)
+        : block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter()),
+          sampler(sampler->clone()) {
+        rays.reserve(NORI_RENDER_BATCH_SIZE);
+        pixelSamples.reserve(NORI_RENDER_BATCH_SIZE);
+        weights.reserve(NORI_RENDER_BATCH_SIZE);
+        values.resize(NORI_RENDER_BATCH_SIZE);
+    }
+
+    ImageBlock block;                  ///< Image block rendered by the thread
+    std::unique_ptr<Sampler> sampler;  ///< Clone of the sampler of the job
+
+    /* Camera ray batch handed to the integrator */
+    std::vector<Ray3f> rays;
+    std::vector<Point2f> pixelSamples;
+    std::vector<Color3f> weights, values;
+};
+
+static void renderBlock(const Scene *scene, const Camera *camera, RenderContext &ctx,
+                        uint32_t sampleCount, AdaptiveSampling *adaptive) {
     const Integrator *integrator = scene->getIntegrator();
+    ImageBlock &block = ctx.block;
+    Sampler *sampler = ctx.sampler.get();
 
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
@@ -46,10 +187,42 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+    /* Camera rays are generated for a batch of pixel samples and handed to
+       the integrator at once, which lets batched (wavefront) integrators
+       trace them together as coherent packets */
+    const size_t batchSize = std::min((size_t) NORI_RENDER_BATCH_SIZE,
+        (size_t) size.x() * size.y() * sampler->getSampleCount());
+    std::vector<Ray3f> &rays = ctx.rays;
+    std::vector<Point2f> &pixelSamples = ctx.pixelSamples;
+    std::vector<Color3f> &weights = ctx.weights, &values = ctx.values;
+
+    auto flush = [&]() {
+        /* Compute the incident radiance */
+        integrator->LiBatch(scene, sampler, rays.data(), values.data(),
+                            (uint32_t) rays.size());
+
+        /* Store in the image block */
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Color3f value = weights[i] * values[i];
+            block.put(pixelSamples[i], value);
+            if (adaptive)
+                adaptive->put(Point2i((int) pixelSamples[i].x(),
+                                      (int) pixelSamples[i].y()), value);
+        }
+
+        rays.clear();
+        pixelSamples.clear();
+        weights.clear();
+    };
+
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
-            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
+            uint32_t pixelSampleCount = adaptive
+                ? adaptive->getSampleCount(offset + Vector2i(x, y))
+                : sampleCount;
+
+            for (uint32_t i=0; i<pixelSampleCount; ++i) {
                 Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
                 Point2f apertureSample = sampler->next2D();
 
@@ -57,66 +230,193 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
                 Ray3f ray;
                 Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
 
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
+                rays.push_back(ray);
+                pixelSamples.push_back(pixelSample);
+                weights.push_back(value);
 
-                /* Store in the image block */
-                block.put(pixelSample, value);
+                if (rays.size() == batchSize)
+                    flush();
             }
         }
     }
+
+    if (!rays.empty())
+        flush();
 }
 
-static void render(Scene *scene, const std::string &filename) {
-    const Camera *camera = scene->getCamera();
-    Vector2i outputSize = camera->getOutputSize();
-    scene->getIntegrator()->preprocess(scene);
+/// Everything that describes a single rendering
+struct RenderJob {
+    std::string sceneFile;   ///< Scene description (identifies checkpoints)
+    std::string outputName;  ///< Output filename without extension
+    const Camera *camera;
+    const Sampler *sampler;
+    Point2i cropOffset;      ///< Rendered region of the image
+    Vector2i cropSize;
+};
+
+/**
+ * \brief Return the number of samples per pixel in each pass
+ *
+ * Without progressive (or adaptive) rendering, there is a single pass
+ */
+static uint32_t getPassSampleCount(const Sampler *sampler) {
+    bool adaptiveSampling = sampler->getAdaptiveThreshold() > 0;
+    if (adaptiveSampling && (samplesPerPass > 0 || checkpointInterval > 0))
+        throw NoriException("Adaptive sampling can't be combined with "
+                            "progressive rendering or checkpoints!");
+    uint32_t sampleCount = (uint32_t) sampler->getSampleCount();
+    if (samplesPerPass > 0)
+        return std::min((uint32_t) samplesPerPass, sampleCount);
+    else if (!adaptiveSampling && (timeBudget > 0 || checkpointInterval > 0))
+        return 1; /* Budgets and checkpoints need several passes */
+    return sampleCount;
+}
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+/**
+ * \brief Identify the checkpoints of a rendering
+ *
+ * A checkpoint can only be resumed by a run with the same scene
+ * description, camera, image region, sample count and samples per pass.
+ * The camera and sample count can differ from the scene description
+ * in batch mode.
+ */
+static uint64_t getCheckpointKey(const RenderJob &job, const ImageBlock &result,
+                                 uint32_t passSampleCount) {
+    MappedFile file(job.sceneFile);
+    uint64_t settings[7] = { (uint64_t) result.rows(), (uint64_t) result.cols(),
+                             (uint64_t) result.getBorderSize(), (uint64_t) passSampleCount,
+                             (uint64_t) job.cropOffset.x(), (uint64_t) job.cropOffset.y(),
+                             (uint64_t) job.sampler->getSampleCount() };
+    std::string camera = job.camera->toString();
+    uint64_t key = hashBytes(file.data(), file.size());
+    key = hashBytes(camera.data(), camera.size(), key);
+    return hashBytes(settings, sizeof(settings), key);
+}
 
-    /* Allocate memory for the entire output image and clear it */
-    ImageBlock result(outputSize, camera->getReconstructionFilter());
-    result.clear();
+/// Store the unnormalized image (including weights and borders) and the pass count
+static bool saveCheckpoint(const std::string &filename, uint64_t key,
+                           const ImageBlock &result, uint32_t pass) {
+    CacheWriter writer(filename, key);
+    writer.write(&pass, sizeof(uint32_t));
+    writer.writeMatrix(result);
+    return writer.commit();
+}
 
-    /* Create a window that visualizes the partially rendered result */
-    nanogui::init();
-    NoriScreen *screen = new NoriScreen(result);
+/// Restore a checkpoint written by \ref saveCheckpoint()
+static bool loadCheckpoint(const std::string &filename, uint64_t key,
+                           ImageBlock &result, uint32_t &pass) {
+    CacheReader reader(filename, key);
+    if (!reader.isValid())
+        return false;
+
+    Eigen::Index rows = result.rows(), cols = result.cols();
+    try {
+        size_t size;
+        const uint8_t *data = reader.read(size);
+        if (size != sizeof(uint32_t))
+            throw NoriException("Invalid checkpoint!");
+        memcpy(&pass, data, sizeof(uint32_t));
+        reader.readMatrix(result);
+        if (result.rows() != rows || result.cols() != cols)
+            throw NoriException("Invalid checkpoint!");
+    } catch (const NoriException &) {
+        result.resize(rows, cols);
+        result.clear();
+        pass = 0;
+        return false;
+    }
+    return true;
+}
 
-    /* Do the following in parallel and asynchronously */
-    std::thread render_thread([&] {
-        tbb::task_scheduler_init init(threadCount);
+/**
+ * \brief Render a job into \c result, whose offset and size must
+ * match the crop window of the job
+ */
+static void renderJob(const Scene *scene, const RenderJob &job, ImageBlock &result) {
+    const Camera *camera = job.camera;
+    const Sampler *jobSampler = job.sampler;
+
+    /* Create a block generator (i.e. a work scheduler). The last blocks are
+       split so that all threads stay busy until the very end */
+    BlockGenerator blockGenerator(job.cropSize, NORI_BLOCK_SIZE,
+        threadCount > 0 ? threadCount : getCoreCount(), job.cropOffset);
+
+    uint32_t sampleCount = (uint32_t) jobSampler->getSampleCount();
+    uint32_t passSampleCount = getPassSampleCount(jobSampler);
+    uint32_t passCount = (sampleCount + passSampleCount - 1) / passSampleCount;
+
+    /* Resume from an earlier checkpoint of the same rendering */
+    uint32_t pass = 0;
+    uint64_t checkpointKey = 0;
+    std::string checkpointName = job.outputName + ".checkpoint";
+    if (checkpointInterval > 0) {
+        checkpointKey = getCheckpointKey(job, result, passSampleCount);
+        if (loadCheckpoint(checkpointName, checkpointKey, result, pass))
+            cout << "Resuming from \"" << checkpointName << "\" after " << pass
+                 << " of " << passCount << " passes." << endl;
+    }
 
-        cout << "Rendering .. ";
-        cout.flush();
-        Timer timer;
+    cout << "Rendering .. ";
+    cout.flush();
+    Timer timer;
 
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+    /* With adaptive sampling, the image is rendered in several passes */
+    std::unique_ptr<AdaptiveSampling> adaptive;
+    if (jobSampler->getAdaptiveThreshold() > 0)
+        adaptive.reset(new AdaptiveSampling(job.cropOffset, job.cropSize, jobSampler));
+    uint32_t passSamples = 0;
 
-        auto map = [&](const tbb::blocked_range<int> &range) {
-            /* Allocate memory for a small image block to be rendered
-               by the current thread */
-            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                camera->getReconstructionFilter());
+    tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
 
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+    /* Rendering contexts of the worker threads, created on first use */
+    tbb::enumerable_thread_specific<std::unique_ptr<RenderContext>> contexts;
 
-            for (int i=range.begin(); i<range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
+    auto map = [&](const tbb::blocked_range<int> &range) {
+        std::unique_ptr<RenderContext> &ctx = contexts.local();
+        if (!ctx)
+            ctx.reset(new RenderContext(camera, jobSampler));
+        ImageBlock &block = ctx->block;
 
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
+        for (int i=range.begin(); i<range.end(); ++i) {
+            /* Request an image block from the block generator */
+            blockGenerator.next(block);
 
-                /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
+            /* Skip blocks that have converged */
+            if (adaptive && !adaptive->isActive(block))
+                continue;
 
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
-            }
-        };
+            /* Inform the sampler about the block to be rendered */
+            ctx->sampler->prepare(block, pass);
+
+            /* Render all contained pixels */
+            renderBlock(scene, camera, *ctx, passSamples, adaptive.get());
+
+            /* The image block has been processed. Now add it to
+               the "big" block that represents the entire image */
+            result.put(block);
+        }
+    };
+
+    auto finished = [&]() {
+        if (adaptive)
+            return adaptive->getActivePixelCount() == 0;
+        return pass >= passCount;
+    };
+
+    Timer checkpointTimer;
+    bool outOfTime = false;
+    while (!finished()) {
+        if (timeBudget > 0 && pass > 0 && timer.elapsed() >= 1000 * timeBudget) {
+            outOfTime = true;
+            break;
+        }
+
+        /* The last pass takes the remaining samples. Adaptive sampling chooses
+           the sample count of each pixel itself and may run further passes */
+        uint64_t rendered = (uint64_t) pass * passSampleCount;
+        passSamples = rendered < sampleCount
+            ? (uint32_t) std::min((uint64_t) passSampleCount, sampleCount - rendered) : 0;
+        blockGenerator.reset();
 
         /// Default: parallel rendering
         tbb::parallel_for(range, map);
@@ -124,7 +424,151 @@ static void render(Scene *scene, const std::string &filename) {
         /// (equivalent to the following single-threaded call)
         // map(range);
 
+        ++pass;
+
+        if (checkpointInterval > 0 && !finished() &&
+            checkpointTimer.elapsed() >= 1000 * checkpointInterval) {
+            if (!saveCheckpoint(checkpointName, checkpointKey, result, pass))
+                cerr << "Unable to write the checkpoint \"" << checkpointName << "\"" << endl;
+            checkpointTimer.reset();
+        }
+    }
+
+    /* Keep the checkpoint of an unfinished rendering, so that it can be continued */
+    if (checkpointInterval > 0) {
+        if (outOfTime)
+            saveCheckpoint(checkpointName, checkpointKey, result, pass);
+        else
+            std::remove(checkpointName.c_str());
+    }
+
+    if (adaptive)
+        cout << "done. (took " << timer.elapsedString() << ", " << pass
+             << " passes, " << adaptive->getAverageSampleCount()
+             << " samples/pixel on average)" << endl;
+    else if (passCount > 1)
+        cout << "done. (took " << timer.elapsedString() << ", " << pass
+             << " of " << passCount << " passes)" << endl;
+    else
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
+}
+
+/**
+ * \brief Normalize the rendered image and save it in the OpenEXR and PNG formats
+ *
+ * Crop windows are saved as partial OpenEXR files (see \ref ImageBlock::saveEXR()),
+ * which \c --merge combines into the final image.
+ */
+static void saveImage(const ImageBlock &result, const RenderJob &job) {
+    /* Now turn the rendered image block into
+       a properly normalized bitmap */
+    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+
+    /* Save using the OpenEXR format */
+    if (job.cropSize != job.camera->getOutputSize())
+        result.saveEXR(job.outputName, job.camera->getOutputSize());
+    else
+        bitmap->saveEXR(job.outputName);
+
+    /* Save tonemapped (sRGB) output using the PNG format */
+    bitmap->savePNG(job.outputName);
+}
+
+/**
+ * \brief Set the crop window of a job from a string of the form
+ * "x,y,width,height" (or from the camera if the string is empty)
+ */
+static void setCropWindow(RenderJob &job, const std::string &crop) {
+    Vector2i outputSize = job.camera->getOutputSize();
+    if (crop.empty()) {
+        job.cropOffset = job.camera->getCropOffset();
+        job.cropSize = job.camera->getCropSize();
+        return;
+    }
+
+    std::vector<std::string> values = tokenize(crop, ",");
+    if (values.size() != 4)
+        throw NoriException("Expected a crop window of the form \"<x>,<y>,<width>,<height>\"");
+    job.cropOffset = Point2i(toInt(values[0]), toInt(values[1]));
+    job.cropSize = Vector2i(toInt(values[2]), toInt(values[3]));
+    if ((job.cropOffset.array() < 0).any() || (job.cropSize.array() <= 0).any() ||
+        ((job.cropOffset + job.cropSize).array() > outputSize.array()).any())
+        throw NoriException("The crop window must lie within the %ix%i image",
+                            outputSize.x(), outputSize.y());
+}
+
+/**
+ * \brief Combine partial renderings of an image (e.g. from several
+ * machines) into the final image
+ *
+ * The partial files overlap by their filter borders; their unnormalized
+ * contents and weights are summed before normalizing.
+ */
+static void merge(const std::string &outputName, const std::vector<std::string> &partials) {
+    Vector2i size(-1, -1);
+    for (const std::string &partial : partials) {
+        Imf::InputFile file(partial.c_str());
+        Imath::Box2i dw = file.header().displayWindow();
+        Vector2i partialSize(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1);
+        if (size.x() >= 0 && partialSize != size)
+            throw NoriException("\"%s\" belongs to an image of a different size!", partial);
+        size = partialSize;
+    }
+
+    ImageBlock result(size, nullptr);
+    result.clear();
+    for (const std::string &partial : partials) {
+        cout << "Merging \"" << partial << "\"" << endl;
+        result.putEXR(partial);
+    }
+
+    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+    bitmap->saveEXR(outputName);
+    bitmap->savePNG(outputName);
+}
+
+/// Allocate the image that a job renders into
+static std::unique_ptr<ImageBlock> createResult(const RenderJob &job) {
+    std::unique_ptr<ImageBlock> result(new ImageBlock(job.cropSize,
+        job.camera->getReconstructionFilter()));
+    result->setOffset(job.cropOffset);
+    result->setRowLocking(true);
+    result->clear();
+    return result;
+}
+
+/// Return the output filename without extension
+static std::string stripExtension(const std::string &filename) {
+    std::string outputName = filename;
+    size_t lastdot = outputName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        outputName.erase(lastdot, std::string::npos);
+    return outputName;
+}
+
+static void render(Scene *scene, const std::string &filename) {
+    const Camera *camera = scene->getCamera();
+    scene->getIntegrator()->preprocess(scene);
+
+    RenderJob job;
+    job.sceneFile = filename;
+    job.outputName = stripExtension(filename);
+    job.camera = camera;
+    job.sampler = scene->getSampler();
+    setCropWindow(job, cropWindow);
+    getPassSampleCount(job.sampler); /* Check the options before starting */
+
+    /* Allocate memory for the entire output image and clear it */
+    std::unique_ptr<ImageBlock> result = createResult(job);
+
+    /* Create a window that visualizes the partially rendered result */
+    nanogui::init();
+    NoriScreen *screen = new NoriScreen(*result);
+
+    /* Do the following in parallel and asynchronously */
+    std::thread render_thread([&] {
+        tbb::task_scheduler_init init(threadCount);
+        renderJob(scene, job, *result);
     });
 
     if(use_gui){
@@ -142,35 +586,125 @@ static void render(Scene *scene, const std::string &filename) {
       render_thread.join();
     }
 
-    /* Now turn the rendered image block into
-       a properly normalized bitmap */
-    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+    saveImage(*result, job);
+}
 
-    /* Determine the filename of the output bitmap */
-    std::string outputName = filename;
-    size_t lastdot = outputName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        outputName.erase(lastdot, std::string::npos);
+/**
+ * \brief Render a stream of jobs with a scene that stays in memory
+ *
+ * Jobs are read from standard input, one per line, as a list of
+ * <tt>key=value</tt> pairs:
+ *
+ * <ul>
+ *   <li><tt>output=&lt;filename&gt;</tt>: where to save the image (required)</li>
+ *   <li><tt>spp=&lt;count&gt;</tt>: override the sample count of the sampler</li>
+ *   <li><tt>camera=&lt;camera.xml&gt;</tt>: replace the camera by the
+ *       <tt>&lt;camera&gt;</tt> element in the given file</li>
+ *   <li><tt>crop=&lt;x&gt;,&lt;y&gt;,&lt;width&gt;,&lt;height&gt;</tt>:
+ *       only render the given region of the image (saved as a partial
+ *       OpenEXR file)</li>
+ * </ul>
+ *
+ * Empty lines and lines starting with '#' are ignored. Errors only
+ * cancel the affected job.
+ */
+static void renderBatch(Scene *scene, const std::string &filename) {
+    tbb::task_scheduler_init init(threadCount);
+    scene->getIntegrator()->preprocess(scene);
 
-    /* Save using the OpenEXR format */
-    bitmap->saveEXR(outputName);
+    cout << "Batch mode: waiting for jobs on standard input." << endl;
 
-    /* Save tonemapped (sRGB) output using the PNG format */
-    bitmap->savePNG(outputName);
+    std::string line;
+    int jobIndex = 0;
+    while (std::getline(std::cin, line)) {
+        std::vector<std::string> tokens = tokenize(line, " \t\r");
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+        ++jobIndex;
+
+        try {
+            Timer timer;
+            RenderJob job;
+            job.sceneFile = filename;
+            job.camera = scene->getCamera();
+
+            std::unique_ptr<NoriObject> camera;
+            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            std::string crop = cropWindow;
+
+            for (const std::string &token : tokens) {
+                size_t pos = token.find('=');
+                if (pos == std::string::npos)
+                    throw NoriException("Expected \"key=value\", got \"%s\"", token);
+                std::string key = token.substr(0, pos), value = token.substr(pos + 1);
+
+                if (key == "output") {
+                    job.outputName = stripExtension(value);
+                } else if (key == "spp") {
+                    int spp = toInt(value);
+                    if (spp <= 0)
+                        throw NoriException("Invalid sample count \"%s\"", value);
+                    sampler->setSampleCount((size_t) spp);
+                } else if (key == "camera") {
+                    camera.reset(loadFromXML(getFileResolver()->resolve(value).str()));
+                    if (camera->getClassType() != NoriObject::ECamera)
+                        throw NoriException("\"%s\" doesn't describe a camera", value);
+                    job.camera = static_cast<const Camera *>(camera.get());
+                } else if (key == "crop") {
+                    crop = value;
+                } else {
+                    throw NoriException("Unknown job setting \"%s\"", key);
+                }
+            }
+            if (job.outputName.empty())
+                throw NoriException("No output file was specified");
+
+            job.sampler = sampler.get();
+            setCropWindow(job, crop);
+
+            cout << "Job " << jobIndex << ": \"" << job.outputName << "\"" << endl;
+            std::unique_ptr<ImageBlock> result = createResult(job);
+            renderJob(scene, job, *result);
+            saveImage(*result, job);
+            cout << "Job " << jobIndex << " finished (latency "
+                 << timer.elapsedString(true) << ")." << endl;
+        } catch (const std::exception &e) {
+            cerr << "Job " << jobIndex << " failed: " << e.what() << endl;
+        }
+    }
 }
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads <count>] [--cache <directory>]" << endl
+             << "           [--progressive <samples per pass>] [--time <seconds>] [--checkpoint <seconds>]" << endl
+             << "           [--batch] [--crop <x>,<y>,<width>,<height>]" << endl
+             << "       " << argv[0] << " --merge <output> <partial.exr> [<partial.exr> ...]" << endl;
         return -1;
     }
 
     std::string sceneName = "";
 
+    if (std::string(argv[1]) == "--merge") {
+        if (argc < 4) {
+            cerr << "\"--merge\" expects an output name and at least one partial OpenEXR file." << endl;
+            return -1;
+        }
+        try {
+            merge(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+        } catch (const std::exception &e) {
+            cerr << "Fatal error: " << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
     for (int i = 1; i < argc; ++i) {
         std::string token(argv[i]);
         if (token == "-n" || token == "--no-gui") {
             use_gui = false;
+        } else if (token == "--batch") {
+            batchMode = true;
         } else if (token == "-t" || token == "--threads") {
             if (i+1 >= argc) {
                 cerr << "\"--threads\" argument expects a positive integer following it." << endl;
@@ -183,6 +717,43 @@ int main(int argc, char **argv) {
                 return -1;
             }
 
+            continue;
+        } else if (token == "--crop") {
+            if (i+1 >= argc) {
+                cerr << "\"--crop\" argument expects a window \"<x>,<y>,<width>,<height>\" following it." << endl;
+                return -1;
+            }
+            cropWindow = argv[i+1];
+            i++;
+            continue;
+        } else if (token == "--progressive") {
+            if (i+1 >= argc || (samplesPerPass = atoi(argv[i+1])) <= 0) {
+                cerr << "\"--progressive\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            i++;
+            continue;
+        } else if (token == "--time" || token == "--checkpoint") {
+            double value = i+1 < argc ? atof(argv[i+1]) : 0;
+            if (value <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive number of seconds following it." << endl;
+                return -1;
+            }
+            (token == "--time" ? timeBudget : checkpointInterval) = value;
+            i++;
+            continue;
+        } else if (token == "--cache") {
+            if (i+1 >= argc) {
+                cerr << "\"--cache\" argument expects a directory following it." << endl;
+                return -1;
+            }
+            try {
+                setCacheDirectory(argv[i+1]);
+            } catch (const std::exception &e) {
+                cerr << "Fatal error: " << e.what() << endl;
+                return -1;
+            }
+            i++;
             continue;
         }
 
@@ -221,10 +792,19 @@ int main(int argc, char **argv) {
     }
 
     if (sceneName != "") {
+        try {
             std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), argv[1]);
+            if (root->getClassType() == NoriObject::EScene) {
+                if (batchMode)
+                    renderBatch(static_cast<Scene *>(root.get()), argv[1]);
+                else
+                    render(static_cast<Scene *>(root.get()), argv[1]);
+            }
+        } catch (const std::exception &e) {
+            cerr << "Fatal error: " << e.what() << endl;
+            return -1;
+        }
     }
 
     return 0;
@@ -22,6 +22,7 @@
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
 #include <nori/warp.h>
+#include <nori/cache.h>
 #include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
@@ -33,6 +34,40 @@ Mesh::~Mesh() {
     delete m_emitter;
 }
 
+bool Mesh::loadFromCache(const std::string &filename, uint64_t key) {
+    CacheReader reader(filename, key);
+    if (!reader.isValid())
+        return false;
+
+    try {
+        reader.readMatrix(m_V);
+        reader.readMatrix(m_N);
+        reader.readMatrix(m_UV);
+        reader.readMatrix(m_F);
+        std::vector<BoundingBox3f> bbox;
+        reader.read(bbox);
+        if (bbox.size() != 1)
+            throw NoriException("Mesh: invalid bounding box in the cache!");
+        m_bbox = bbox[0];
+    } catch (const NoriException &) {
+        /* Truncated or otherwise damaged file */
+        m_V.resize(0, 0); m_N.resize(0, 0); m_UV.resize(0, 0); m_F.resize(0, 0);
+        m_bbox.reset();
+        return false;
+    }
+    return true;
+}
+
+bool Mesh::saveToCache(const std::string &filename, uint64_t key) const {
+    CacheWriter writer(filename, key);
+    writer.writeMatrix(m_V);
+    writer.writeMatrix(m_N);
+    writer.writeMatrix(m_UV);
+    writer.writeMatrix(m_F);
+    writer.write(&m_bbox, sizeof(BoundingBox3f));
+    return writer.commit();
+}
+
 void Mesh::activate() {
     if (!m_bsdf) {
         /* If no material was assigned, instantiate a diffuse BRDF */
@@ -49,10 +84,87 @@ void Mesh::activate() {
     }
 
     m_areaPDF.normalize();
+
+    compressStorage();
+}
+
+void Mesh::setStorage(const PropertyList &propList) {
+    std::string normals = propList.getString("normalStorage", "float");
+    if (normals == "float")
+        m_normalStorage = EFloatNormals;
+    else if (normals == "octahedral")
+        m_normalStorage = EOctahedralNormals;
+    else
+        throw NoriException("Mesh: unsupported normal storage \"%s\" (expected "
+            "\"float\" or \"octahedral\")!", normals);
+
+    std::string texcoords = propList.getString("texcoordStorage", "float");
+    if (texcoords == "float")
+        m_texcoordStorage = EFloatTexCoords;
+    else if (texcoords == "half")
+        m_texcoordStorage = EHalfTexCoords;
+    else
+        throw NoriException("Mesh: unsupported texture coordinate storage \"%s\" "
+            "(expected \"float\" or \"half\")!", texcoords);
+
+    m_compactIndices = propList.getBoolean("compactIndices", false);
+}
+
+void Mesh::compressStorage() {
+    if (m_normalStorage == EOctahedralNormals && m_N.size() > 0) {
+        m_Noct.resize(1, m_N.cols());
+        for (uint32_t i = 0; i < (uint32_t) m_N.cols(); ++i)
+            m_Noct(0, i) = encodeOctahedral(m_N.col(i));
+        m_N.resize(0, 0);
+    }
+
+    if (m_texcoordStorage == EHalfTexCoords && m_UV.size() > 0) {
+        m_UV16.resize(2, m_UV.cols());
+        for (uint32_t i = 0; i < (uint32_t) m_UV.cols(); ++i) {
+            m_UV16(0, i) = half(m_UV(0, i)).bits();
+            m_UV16(1, i) = half(m_UV(1, i)).bits();
+        }
+        m_UV.resize(0, 0);
+    }
+
+    /* Only possible if every index fits into 16 bits */
+    if (m_compactIndices && m_F.size() > 0 && m_V.cols() <= 0x10000) {
+        m_F16 = m_F.cast<uint16_t>();
+        m_F.resize(0, 0);
+    }
+}
+
+uint32_t Mesh::encodeOctahedral(const Normal3f &n) {
+    /* Project onto the octahedron, then fold the lower hemisphere over */
+    Normal3f p = n / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    float x = p.x(), y = p.y();
+    if (p.z() < 0.f) {
+        x = std::copysign(1.f - std::abs(p.y()), p.x());
+        y = std::copysign(1.f - std::abs(p.x()), p.y());
+    }
+
+    /* Among the four surrounding grid points, keep the most accurate one */
+    float fx = std::floor(clamp(x, -1.f, 1.f) * 32767.f),
+          fy = std::floor(clamp(y, -1.f, 1.f) * 32767.f);
+    uint32_t best = 0;
+    float bestError = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        int ix = (int) clamp(fx + (i & 1), -32767.f, 32767.f),
+            iy = (int) clamp(fy + (i >> 1), -32767.f, 32767.f);
+        uint32_t value = (uint32_t) (uint16_t) (int16_t) ix |
+                         ((uint32_t) (uint16_t) (int16_t) iy << 16);
+        float error = (decodeOctahedral(value) - n).squaredNorm();
+        if (error < bestError) {
+            bestError = error;
+            best = value;
+        }
+    }
+    return best;
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0, i1, i2;
+    getTriangle(index, i0, i1, i2);
 
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
@@ -60,65 +172,43 @@ float Mesh::surfaceArea(uint32_t index) const {
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0, i1, i2;
+    getTriangle(index, i0, i1, i2);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
 
-    /* Begin calculating determinant - also used to calculate U parameter */
-    Vector3f pvec = ray.d.cross(edge2);
-
-    /* If determinant is near zero, ray lies in plane of triangle */
-    float det = edge1.dot(pvec);
-
-    if (det > -1e-8f && det < 1e-8f)
-        return false;
-    float inv_det = 1.0f / det;
-
-    /* Calculate distance from v[0] to ray origin */
-    Vector3f tvec = ray.o - p0;
-
-    /* Calculate U parameter and test bounds */
-    u = tvec.dot(pvec) * inv_det;
-    if (u < 0.0 || u > 1.0)
-        return false;
-
-    /* Prepare to test V parameter */
-    Vector3f qvec = tvec.cross(edge1);
-
-    /* Calculate V parameter and test bounds */
-    v = ray.d.dot(qvec) * inv_det;
-    if (v < 0.0 || u + v > 1.0)
-        return false;
-
-    /* Ray intersects triangle -> compute t */
-    t = edge2.dot(qvec) * inv_det;
-
-    return t >= ray.mint && t <= ray.maxt;
+    return rayIntersect(p0, edge1, edge2, ray, u, v, t);
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    uint32_t i0, i1, i2;
+    getTriangle(index, i0, i1, i2);
+    BoundingBox3f result(m_V.col(i0));
+    result.expandBy(m_V.col(i1));
+    result.expandBy(m_V.col(i2));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    uint32_t i0, i1, i2;
+    getTriangle(index, i0, i1, i2);
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (m_V.col(i0) +
+         m_V.col(i1) +
+         m_V.col(i2));
 }
 void Mesh::samplePosition(const Point2f &sample,
                           Point3f &p,
                           Normal3f &n) const {
-    // 1. Sample a triangle proportional to area
-    float pdfTri;
-    uint32_t triIndex = m_areaPDF.sample(sample.x(), pdfTri);
+    // 1. Sample a triangle proportional to area (in constant time). The
+    // remainder of the sample is reused for the position on the triangle
+    float sampleX = sample.x();
+    uint32_t triIndex = sampleTriangle(sampleX);
 
-    const Vector3i &f = m_F.col(triIndex);
+    uint32_t f[3];
+    getTriangle(triIndex, f[0], f[1], f[2]);
 
     const Point3f &v0 = m_V.col(f[0]);
     const Point3f &v1 = m_V.col(f[1]);
@@ -126,7 +216,7 @@ void Mesh::samplePosition(const Point2f &sample,
 
     // 2. Uniform barycentric sampling
     // (classic sqrt trick)
-    float r1 = std::sqrt(sample.y());
+    float r1 = std::sqrt(sampleX);
     float r2 = sample.y();
 
     float b0 = 1.f - r1;
@@ -136,10 +226,10 @@ void Mesh::samplePosition(const Point2f &sample,
     p = b0 * v0 + b1 * v1 + b2 * v2;
 
     // 3. Normal interpolation
-    if (m_N.size() > 0) {
-        const Normal3f &n0 = m_N.col(f[0]);
-        const Normal3f &n1 = m_N.col(f[1]);
-        const Normal3f &n2 = m_N.col(f[2]);
+    if (hasVertexNormals()) {
+        const Normal3f n0 = getVertexNormal(f[0]);
+        const Normal3f n1 = getVertexNormal(f[1]);
+        const Normal3f n2 = getVertexNormal(f[2]);
 
         n = (b0 * n0 + b1 * n1 + b2 * n2).normalized();
     } else {
@@ -183,7 +273,7 @@ std::string Mesh::toString() const {
         "]",
         m_name,
         m_V.cols(),
-        m_F.cols(),
+        getTriangleCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
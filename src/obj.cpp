@@ -18,117 +18,86 @@
 
 #include <nori/mesh.h>
 #include <nori/timer.h>
+#include <nori/cache.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into chunks of whole lines, which
+ * are processed in parallel:
+ *
+ *  1. count the \c v, \c vt and \c vn statements of every chunk. This
+ *     gives the global index of every attribute, so that they can be
+ *     stored in place and negative (relative) indices can be resolved.
+ *  2. parse the attributes and faces of every chunk
+ *  3. deduplicate the face vertices within every chunk, then merge the
+ *     per-chunk vertex lists in file order. This numbers the vertices in
+ *     order of their first occurrence, exactly like a serial parser.
+ *  4. assemble the vertex and index buffers
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        std::unique_ptr<MappedFile> file;
+        try {
+            file.reset(new MappedFile(filename.str()));
+        } catch (const NoriException &) {
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        }
         Transform trafo = propList.getTransform("toWorld", Transform());
+        setStorage(propList);
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
+        m_name = filename.str();
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
+        auto printSummary = [&](const char *note) {
+            cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+                 << timer.elapsedString() << " and "
+                 << memString(m_F.size() * sizeof(uint32_t) +
+                              sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+                 << note << ")" << endl;
+        };
 
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+        /* Reuse the binary cache if neither the file nor the transform changed */
+        uint64_t cacheKey = 0;
+        std::string cacheFile;
+        if (!getCacheDirectory().empty()) {
+            cacheKey = hashBytes(file->data(), file->size());
+            cacheKey = hashBytes(trafo.getMatrix().data(), sizeof(float) * 16, cacheKey);
+            cacheFile = getCacheFilename("mesh", cacheKey);
+            if (loadFromCache(cacheFile, cacheKey)) {
+                printSummary(", from cache");
+                return;
             }
         }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        parse((const char *) file->data(), file->size(), trafo);
+        file.reset();
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
-
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
-        }
-
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+        if (!cacheFile.empty()) {
+            if (saveToCache(cacheFile, cacheKey))
+                printSummary(", cache written");
+            else
+                printSummary(", unable to write the cache");
+        } else {
+            printSummary("");
         }
-
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
     }
 
 protected:
@@ -138,37 +107,466 @@ protected:
         uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
 
-        inline OBJVertex() { }
-
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+    /// Flat hash map from OBJ vertices to indices (open addressing, linear probing)
+    class VertexMap {
+    public:
+        VertexMap() { rehash(1024); }
 
-            p = toUInt(tokens[0]);
+        /// Return the index of \c v, or insert it with index \c next if it's new
+        uint32_t insert(const OBJVertex &v, uint32_t next) {
+            if (2 * (m_size + 1) > m_values.size())
+                rehash(2 * m_values.size());
+            size_t i = hash(v) & m_mask;
+            while (m_values[i] != Empty) {
+                if (m_keys[i] == v)
+                    return m_values[i];
+                i = (i + 1) & m_mask;
+            }
+            m_keys[i] = v;
+            m_values[i] = next;
+            m_size++;
+            return next;
+        }
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+    private:
+        enum : uint32_t { Empty = 0xFFFFFFFFu };
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        static size_t hash(const OBJVertex &v) {
+            uint64_t h = v.p * 0x9E3779B97F4A7C15ull;
+            h = (h ^ (h >> 29) ^ v.uv) * 0xBF58476D1CE4E5B9ull;
+            h = (h ^ (h >> 32) ^ v.n) * 0x94D049BB133111EBull;
+            return (size_t) (h ^ (h >> 31));
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        void rehash(size_t capacity) {
+            std::vector<OBJVertex> keys(capacity);
+            std::vector<uint32_t> values(capacity, (uint32_t) Empty);
+            keys.swap(m_keys);
+            values.swap(m_values);
+            m_mask = capacity - 1;
+            m_size = 0;
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (values[i] != Empty)
+                    insert(keys[i], values[i]);
+            }
         }
+
+        std::vector<OBJVertex> m_keys;
+        std::vector<uint32_t> m_values;
+        size_t m_mask = 0, m_size = 0;
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
-        }
+    /// A range of whole lines of the file and the data parsed from it
+    struct Chunk {
+        const char *begin, *end;
+
+        /* Number of attributes defined in this chunk and before it */
+        uint32_t positionCount = 0, texcoordCount = 0, normalCount = 0;
+        uint32_t positionOffset = 0, texcoordOffset = 0, normalOffset = 0;
+
+        std::vector<OBJVertex> faceVertices; ///< Three per triangle
+        std::vector<OBJVertex> unique;       ///< Distinct vertices (in order of appearance)
+        std::vector<uint32_t> indices;       ///< Face vertices as indices into \c unique
+        std::vector<uint32_t> remap;         ///< Global index of every entry of \c unique
+        uint32_t indexOffset = 0;            ///< First index of this chunk in \ref m_F
+        BoundingBox3f bbox;                  ///< Bounds of the positions of this chunk
+        std::string error;                   ///< Parse error, if any
     };
+
+    /// Statement types that are relevant for triangle meshes
+    enum EStatement { EOther = 0, EPosition, ETexCoord, ENormal, EFace };
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    /// Return the next whitespace-delimited token of a line (empty at its end)
+    static void nextToken(const char *&ptr, const char *end,
+                          const char *&tokenBegin, const char *&tokenEnd) {
+        while (ptr < end && isSpace(*ptr))
+            ++ptr;
+        tokenBegin = ptr;
+        while (ptr < end && !isSpace(*ptr))
+            ++ptr;
+        tokenEnd = ptr;
+    }
+
+    /// Read the keyword at the beginning of a line
+    static EStatement parseStatement(const char *&ptr, const char *end) {
+        const char *begin, *tokenEnd;
+        nextToken(ptr, end, begin, tokenEnd);
+        size_t length = tokenEnd - begin;
+        if (length == 1 && begin[0] == 'v')
+            return EPosition;
+        else if (length == 1 && begin[0] == 'f')
+            return EFace;
+        else if (length == 2 && begin[0] == 'v' && begin[1] == 't')
+            return ETexCoord;
+        else if (length == 2 && begin[0] == 'v' && begin[1] == 'n')
+            return ENormal;
+        return EOther;
+    }
+
+    /**
+     * \brief Parse a floating point number
+     *
+     * The fast path handles the usual plain decimal notation with up to
+     * 19 significant digits and gives the same correctly rounded result
+     * as \c strtof(), which is used for all other cases.
+     */
+    static float parseFloat(const char *begin, const char *end) {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        const char *ptr = begin;
+        bool negative = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+            negative = *ptr++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        bool valid = false, truncated = false;
+        for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr) {
+            valid = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+                digits += mantissa != 0;
+            } else {
+                truncated |= *ptr != '0';
+                exponent++;
+            }
+        }
+        if (ptr < end && *ptr == '.') {
+            for (++ptr; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr) {
+                valid = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+                    digits += mantissa != 0;
+                    exponent--;
+                } else {
+                    truncated |= *ptr != '0';
+                }
+            }
+        }
+        if (valid && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+            ++ptr;
+            bool negativeExp = false;
+            if (ptr < end && (*ptr == '-' || *ptr == '+'))
+                negativeExp = *ptr++ == '-';
+            int value = 0;
+            valid = ptr < end && *ptr >= '0' && *ptr <= '9';
+            for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr)
+                value = std::min(value * 10 + (*ptr - '0'), 100000);
+            exponent += negativeExp ? -value : value;
+        }
+
+        /* Both the mantissa and the power of ten are exact doubles here, so
+           the double result is correctly rounded. Rounding it to float is
+           only wrong if it ended up exactly halfway between two floats */
+        if (valid && !truncated && ptr == end && mantissa <= (1ull << 53) &&
+            exponent >= -22 && exponent <= 22) {
+            double value = exponent < 0 ? mantissa / powers[-exponent]
+                                        : mantissa * powers[exponent];
+            float result = (float) value;
+            double error = value - (double) result;
+            bool halfway = false;
+            if (error != 0) {
+                float next = std::nextafter(result, error > 0 ? FLT_MAX : -FLT_MAX);
+                halfway = 2 * std::abs(error) == std::abs((double) next - (double) result);
+            }
+            if (!halfway)
+                return negative ? -result : result;
+        }
+
+        std::string token(begin, end);
+        return strtof(token.c_str(), nullptr);
+    }
+
+    /// Parse an OBJ index. Returns \c false if the text isn't a valid integer
+    static bool parseIndex(const char *begin, const char *end, int64_t &result) {
+        const char *ptr = begin;
+        bool negative = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+            negative = *ptr++ == '-';
+        if (ptr == end)
+            return false;
+        int64_t value = 0;
+        for (; ptr < end; ++ptr) {
+            if (*ptr < '0' || *ptr > '9' || value > 0xFFFFFFFFll)
+                return false;
+            value = value * 10 + (*ptr - '0');
+        }
+        result = negative ? -value : value;
+        return true;
+    }
+
+    /**
+     * \brief Convert a (1-based, possibly negative) OBJ index into a 1-based
+     * absolute index, given the number of elements defined so far
+     */
+    static uint32_t resolveIndex(const char *begin, const char *end, uint32_t count) {
+        int64_t value;
+        if (!parseIndex(begin, end, value) || value == 0)
+            throw NoriException("Invalid vertex index \"%s\"", std::string(begin, end));
+        if (value < 0)
+            value += (int64_t) count + 1;
+        if (value <= 0)
+            throw NoriException("Invalid relative vertex index \"%s\"", std::string(begin, end));
+        return (uint32_t) value;
+    }
+
+    /// Parse a face vertex (<tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>)
+    static OBJVertex parseVertex(const char *begin, const char *end,
+                                 uint32_t positions, uint32_t texcoords,
+                                 uint32_t normals) {
+        const char *slash1 = std::find(begin, end, '/');
+        const char *slash2 = slash1 == end ? end : std::find(slash1 + 1, end, '/');
+        if (slash2 != end && std::find(slash2 + 1, end, '/') != end)
+            throw NoriException("Invalid vertex data: \"%s\"", std::string(begin, end));
+
+        OBJVertex v;
+        v.p = resolveIndex(begin, slash1, positions);
+        if (slash1 != end && slash1 + 1 != slash2)
+            v.uv = resolveIndex(slash1 + 1, slash2, texcoords);
+        if (slash2 != end && slash2 + 1 != end)
+            v.n = resolveIndex(slash2 + 1, end, normals);
+        return v;
+    }
+
+    /// Pass 1: count the attributes defined in a chunk
+    static void countAttributes(Chunk &chunk) {
+        for (const char *ptr = chunk.begin; ptr < chunk.end; ) {
+            const char *lineEnd = (const char *) memchr(ptr, '\n', chunk.end - ptr);
+            if (!lineEnd)
+                lineEnd = chunk.end;
+            switch (parseStatement(ptr, lineEnd)) {
+                case EPosition: chunk.positionCount++; break;
+                case ETexCoord: chunk.texcoordCount++; break;
+                case ENormal:   chunk.normalCount++; break;
+                default: break;
+            }
+            ptr = lineEnd + 1;
+        }
+    }
+
+    /// Pass 2: parse the attributes and faces of a chunk
+    static void parseChunk(Chunk &chunk, const Transform &trafo,
+                           std::vector<Vector3f> &positions,
+                           std::vector<Vector2f> &texcoords,
+                           std::vector<Vector3f> &normals) {
+        uint32_t positionIdx = chunk.positionOffset,
+                 texcoordIdx = chunk.texcoordOffset,
+                 normalIdx = chunk.normalOffset;
+        const char *begin, *end;
+
+        for (const char *ptr = chunk.begin; ptr < chunk.end; ) {
+            const char *lineEnd = (const char *) memchr(ptr, '\n', chunk.end - ptr);
+            if (!lineEnd)
+                lineEnd = chunk.end;
+
+            switch (parseStatement(ptr, lineEnd)) {
+                case EPosition: {
+                        Point3f p = Point3f::Zero();
+                        for (int i = 0; i < 3; ++i) {
+                            nextToken(ptr, lineEnd, begin, end);
+                            if (begin != end)
+                                p[i] = parseFloat(begin, end);
+                        }
+                        p = trafo * p;
+                        chunk.bbox.expandBy(p);
+                        positions[positionIdx++] = p;
+                    }
+                    break;
+
+                case ETexCoord: {
+                        Point2f tc = Point2f::Zero();
+                        for (int i = 0; i < 2; ++i) {
+                            nextToken(ptr, lineEnd, begin, end);
+                            if (begin != end)
+                                tc[i] = parseFloat(begin, end);
+                        }
+                        texcoords[texcoordIdx++] = tc;
+                    }
+                    break;
+
+                case ENormal: {
+                        Normal3f n = Normal3f::Zero();
+                        for (int i = 0; i < 3; ++i) {
+                            nextToken(ptr, lineEnd, begin, end);
+                            if (begin != end)
+                                n[i] = parseFloat(begin, end);
+                        }
+                        normals[normalIdx++] = (trafo * n).normalized();
+                    }
+                    break;
+
+                case EFace: {
+                        /* At most four vertices are used; a quad is split
+                           into two triangles */
+                        OBJVertex verts[4];
+                        int nVertices = 0;
+                        for (; nVertices < 4; ++nVertices) {
+                            nextToken(ptr, lineEnd, begin, end);
+                            if (begin == end)
+                                break;
+                            verts[nVertices] = parseVertex(begin, end, positionIdx,
+                                                           texcoordIdx, normalIdx);
+                        }
+                        if (nVertices < 3)
+                            throw NoriException("Invalid vertex data: a face "
+                                                "needs at least three vertices");
+
+                        chunk.faceVertices.push_back(verts[0]);
+                        chunk.faceVertices.push_back(verts[1]);
+                        chunk.faceVertices.push_back(verts[2]);
+                        if (nVertices == 4) {
+                            chunk.faceVertices.push_back(verts[3]);
+                            chunk.faceVertices.push_back(verts[0]);
+                            chunk.faceVertices.push_back(verts[2]);
+                        }
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+            ptr = lineEnd + 1;
+        }
+    }
+
+    /// Pass 3: deduplicate the face vertices of a chunk
+    static void deduplicate(Chunk &chunk) {
+        VertexMap map;
+        chunk.indices.resize(chunk.faceVertices.size());
+        for (size_t i = 0; i < chunk.faceVertices.size(); ++i) {
+            const OBJVertex &v = chunk.faceVertices[i];
+            uint32_t index = map.insert(v, (uint32_t) chunk.unique.size());
+            if (index == chunk.unique.size())
+                chunk.unique.push_back(v);
+            chunk.indices[i] = index;
+        }
+        std::vector<OBJVertex>().swap(chunk.faceVertices);
+    }
+
+    void parse(const char *data, size_t size, const Transform &trafo) {
+        /* Split the file into chunks of whole lines */
+        const size_t chunkSize = 4 * 1024 * 1024;
+        std::vector<Chunk> chunks;
+        for (size_t pos = 0; pos < size; ) {
+            size_t end = std::min(pos + chunkSize, size);
+            const char *newline = (const char *) memchr(data + end, '\n', size - end);
+            end = newline ? (size_t) (newline - data) + 1 : size;
+            Chunk chunk;
+            chunk.begin = data + pos;
+            chunk.end = data + end;
+            chunks.push_back(std::move(chunk));
+            pos = end;
+        }
+
+        auto forEachChunk = [&](const std::function<void(Chunk &)> &func) {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size(), 1),
+                [&](const tbb::blocked_range<size_t> &range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        try {
+                            func(chunks[i]);
+                        } catch (const std::exception &e) {
+                            chunks[i].error = e.what();
+                        }
+                    }
+                }
+            );
+
+            /* Report the first error in file order */
+            for (const Chunk &chunk : chunks) {
+                if (!chunk.error.empty())
+                    throw NoriException("%s", chunk.error);
+            }
+        };
+
+        /* Pass 1: count the attributes to find out where each chunk stores them */
+        forEachChunk(countAttributes);
+        uint32_t positionCount = 0, texcoordCount = 0, normalCount = 0;
+        for (Chunk &chunk : chunks) {
+            chunk.positionOffset = positionCount;
+            chunk.texcoordOffset = texcoordCount;
+            chunk.normalOffset = normalCount;
+            positionCount += chunk.positionCount;
+            texcoordCount += chunk.texcoordCount;
+            normalCount += chunk.normalCount;
+        }
+
+        /* Pass 2: parse everything */
+        std::vector<Vector3f> positions(positionCount);
+        std::vector<Vector2f> texcoords(texcoordCount);
+        std::vector<Vector3f> normals(normalCount);
+        forEachChunk([&](Chunk &chunk) {
+            parseChunk(chunk, trafo, positions, texcoords, normals);
+        });
+        for (const Chunk &chunk : chunks)
+            m_bbox.expandBy(chunk.bbox);
+
+        /* Pass 3: deduplicate the vertices of each chunk, then merge them in
+           file order. Only the merge is serial, and it only sees vertices
+           that are distinct within their chunk */
+        forEachChunk(deduplicate);
+        std::vector<OBJVertex> vertices;
+        VertexMap vertexMap;
+        uint32_t indexCount = 0;
+        for (Chunk &chunk : chunks) {
+            chunk.remap.resize(chunk.unique.size());
+            for (size_t i = 0; i < chunk.unique.size(); ++i) {
+                const OBJVertex &v = chunk.unique[i];
+                uint32_t index = vertexMap.insert(v, (uint32_t) vertices.size());
+                if (index == vertices.size()) {
+                    /* Every attribute of a vertex is used below, hence the checks */
+                    if (v.p > positionCount ||
+                        (!texcoords.empty() && (v.uv == (uint32_t) -1 || v.uv > texcoordCount)) ||
+                        (!normals.empty() && (v.n == (uint32_t) -1 || v.n > normalCount)))
+                        throw NoriException("Invalid vertex data: reference to an "
+                                            "undefined position, normal or texture coordinate");
+                    vertices.push_back(v);
+                }
+                chunk.remap[i] = index;
+            }
+            std::vector<OBJVertex>().swap(chunk.unique);
+            chunk.indexOffset = indexCount;
+            indexCount += (uint32_t) chunk.indices.size();
+        }
+
+        /* Pass 4: assemble the index and vertex buffers */
+        m_F.resize(3, indexCount / 3);
+        forEachChunk([&](Chunk &chunk) {
+            uint32_t *target = m_F.data() + chunk.indexOffset;
+            for (size_t i = 0; i < chunk.indices.size(); ++i)
+                target[i] = chunk.remap[chunk.indices[i]];
+        });
+
+        m_V.resize(3, vertices.size());
+        if (!normals.empty())
+            m_N.resize(3, vertices.size());
+        if (!texcoords.empty())
+            m_UV.resize(2, vertices.size());
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices.size(), 4096),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = vertices[i];
+                    m_V.col(i) = positions[v.p - 1];
+                    if (!normals.empty())
+                        m_N.col(i) = normals[v.n - 1];
+                    if (!texcoords.empty())
+                        m_UV.col(i) = texcoords[v.uv - 1];
+                }
+            }
+        );
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
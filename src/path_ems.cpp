@@ -22,15 +22,6 @@ public:
         int depth = 0;
         bool includeEmitted = true; // "lastBounceSpecular" logic for EMS
 
-        // Pre-collect emitters
-        std::vector<const Emitter *> emitters;
-        for (uint32_t i = 0; i < scene->getAccel()->getMeshCount(); ++i) {
-            const Mesh *mesh = scene->getAccel()->getMesh(i);
-            if (mesh->isEmitter()) {
-                emitters.push_back(mesh->getEmitter());
-            }
-        }
-        
         while (depth < 20) {
             Intersection its;
             if (!scene->rayIntersect(currentRay, its))
@@ -48,18 +39,17 @@ public:
             }
 
             // Next event estimation
-            if (!emitters.empty() && its.bsdf) {
-                size_t lightIdx = std::min(
-                    (size_t)(sampler->next1D() * emitters.size()), 
-                    emitters.size() - 1
-                );
-                const Emitter *emitter = emitters[lightIdx];
+            if (scene->getEmitterCount() > 0 && its.bsdf) {
+                // Pick a light
+                float lightChoicePdf;
+                const Emitter *emitter = scene->sampleEmitter(its.p, sampler->next1D(), lightChoicePdf);
                 
                 EmitterQueryRecord lRec;
                 lRec.ref = its.p;
                 
-                float lightPdf; 
-                Color3f Le = emitter->sample(lRec, sampler->next2D(), lightPdf);
+                float lightPdf = 0.0f;
+                Color3f Le = emitter ? emitter->sample(lRec, sampler->next2D(), lightPdf)
+                                   : Color3f(0.0f);
                 
                 if (!Le.isZero() && lightPdf > 0.0f) {
                     BSDFQueryRecord bRec(
@@ -77,7 +67,7 @@ public:
                             float cosAtLight   = std::abs(lRec.n.dot(-lRec.wi));
                             float distSq       = lRec.dist * lRec.dist;
                             float G            = cosAtLight / distSq; 
-                            float weightFactor = (float)emitters.size();
+                            float weightFactor = 1.0f / lightChoicePdf;
 
                             // EMS Contribution
                             Lo += throughput * fr * Le * cosAtShading * G * weightFactor / lightPdf;
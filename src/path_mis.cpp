@@ -23,15 +23,6 @@ public:
         float lastBsdfPdf = 0.0f;       // PDF of the direction we arrived from (for MIS)
         bool lastBounceSpecular = true; // Start true to accept camera rays full weight
 
-        // Pre-collect emitters
-        std::vector<const Emitter*> emitters;
-        for (uint32_t i = 0; i < scene->getAccel()->getMeshCount(); ++i) {
-            const Mesh *mesh = scene->getAccel()->getMesh(i);
-            if (mesh->isEmitter()) {
-                emitters.push_back(mesh->getEmitter());
-            }
-        }
-
         while (depth < 20) {
             Intersection its;
             if (!scene->rayIntersect(currentRay, its))
@@ -45,6 +36,7 @@ public:
                 lRec.n = its.shFrame.n;
                 lRec.wi = -currentRay.d;
                 lRec.dist = its.t;
+                lRec.primIndex = its.primIndex;
 
                 Color3f Le = its.emitter->eval(lRec);
 
@@ -52,7 +44,7 @@ public:
                     float misWeight = 1.0f;
 
                     // If we arrived via a Diffuse bounce, we must balance against NEE
-                    if (!lastBounceSpecular && !emitters.empty()) {
+                    if (!lastBounceSpecular) {
                         float pdfLightArea = its.emitter->pdf(lRec); 
                         
                         // Geometry terms (recalculated here for the 'virtual' NEE ray)
@@ -64,7 +56,7 @@ public:
                         float pdfLightSa = pdfLightArea / G;
                         
                         // Weight by selection probability
-                        float effectivePdfLight = pdfLightSa / (float)emitters.size();
+                        float effectivePdfLight = pdfLightSa * scene->emitterPdf(lRec.ref, its.emitter);
 
                         // Balance Heuristic
                         misWeight = lastBsdfPdf / (lastBsdfPdf + effectivePdfLight + 1e-5f);
@@ -75,15 +67,16 @@ public:
             }
 
             // Next event estimation
-            if (!emitters.empty() && its.bsdf) {
+            if (scene->getEmitterCount() > 0 && its.bsdf) {
                 // Pick a light
-                size_t lightIdx = std::min((size_t)(sampler->next1D() * emitters.size()), emitters.size() - 1);
-                const Emitter *emitter = emitters[lightIdx];
+                float lightChoicePdf;
+                const Emitter *emitter = scene->sampleEmitter(its.p, sampler->next1D(), lightChoicePdf);
 
                 EmitterQueryRecord lRec;
                 lRec.ref = its.p;
-                float lightPdf; // Area Measure
-                Color3f Le = emitter->sample(lRec, sampler->next2D(), lightPdf);
+                float lightPdf = 0.0f; // Area Measure
+                Color3f Le = emitter ? emitter->sample(lRec, sampler->next2D(), lightPdf)
+                                   : Color3f(0.0f);
 
                 if (!Le.isZero() && lightPdf > 0.0f) {
                     BSDFQueryRecord bRec(its.toLocal(-currentRay.d), its.toLocal(lRec.wi), ESolidAngle);
@@ -97,7 +90,7 @@ public:
                             float cosAtLight   = std::abs(lRec.n.dot(-lRec.wi));
                             float distSq       = lRec.dist * lRec.dist;
                             float G            = cosAtLight / distSq;
-                            float weightFactor = (float)emitters.size();
+                            float weightFactor = 1.0f / lightChoicePdf;
 
                             // MIS Calculation
                             float pdfBsdf = its.bsdf->pdf(bRec);
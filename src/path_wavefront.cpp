@@ -0,0 +1,265 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/sampler.h>
+#include <nori/mesh.h>
+#include <nori/ray.h>
+#include <nori/common.h>
+#include <algorithm>
+#include <limits>
+#include <tbb/enumerable_thread_specific.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Breadth-first ("wavefront") version of the MIS path tracer
+ *
+ * Instead of following one path at a time until it terminates, this
+ * integrator keeps a pool of paths in SoA arrays and advances all of them
+ * by one bounce at a time:
+ *
+ *  1. extend: trace the next ray of every path as packets
+ *  2. shade: emitter hits, next event estimation and BSDF sampling,
+ *     processed in BSDF order so that the same material code and data
+ *     is used for many paths in a row
+ *  3. connect: trace all shadow rays of the bounce as packets
+ *  4. compact: remove terminated paths from the pool
+ *
+ * The estimator itself is the same as the one of \c path_mis.
+ */
+class PathWavefrontIntegrator : public Integrator {
+public:
+    PathWavefrontIntegrator(const PropertyList &props) {
+        /* Number of paths that are advanced together */
+        m_poolSize = (uint32_t) props.getInteger("poolSize", 4096);
+        if (m_poolSize == 0)
+            throw NoriException("path_wavefront: the pool size must be positive!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+        Color3f result;
+        LiBatch(scene, sampler, &ray, &result, 1);
+        return result;
+    }
+
+    void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                 Color3f *result, uint32_t count) const override {
+        // The pool of each thread keeps its memory across calls
+        PathPool &pool = m_pools.local();
+        for (uint32_t offset = 0; offset < count; offset += m_poolSize) {
+            uint32_t size = std::min(m_poolSize, count - offset);
+            tracePaths(scene, sampler, pool, rays + offset,
+                       result + offset, size);
+        }
+    }
+
+    std::string toString() const override {
+        return tfm::format("PathWavefrontIntegrator[poolSize=%i]", m_poolSize);
+    }
+
+protected:
+    /// Path states of a wavefront in SoA layout
+    struct PathPool {
+        std::vector<Ray3f> ray;             ///< Next ray to be traced
+        std::vector<Color3f> throughput;    ///< Path throughput
+        std::vector<float> lastBsdfPdf;     ///< PDF of the direction we arrived from (for MIS)
+        std::vector<uint8_t> lastSpecular;  ///< Did we arrive via a specular bounce?
+        std::vector<uint32_t> pixel;        ///< Index of the associated result
+        std::vector<uint8_t> alive;         ///< Does the path continue after this bounce?
+        std::vector<Intersection> its;      ///< Intersection of the current bounce
+        std::vector<uint32_t> order;        ///< Shading order (sorted by BSDF)
+        std::vector<uint8_t> shadowValid;   ///< Did next event estimation create a shadow ray?
+        std::vector<Ray3f> shadowRay;       ///< Shadow rays of the current bounce
+        std::vector<Color3f> shadowValue;   ///< Their contribution if unoccluded
+        std::vector<uint32_t> shadowPixel;  ///< Index of the associated result
+
+        void resize(uint32_t size) {
+            ray.resize(size); throughput.resize(size);
+            lastBsdfPdf.resize(size); lastSpecular.resize(size);
+            pixel.resize(size); alive.resize(size); its.resize(size);
+            order.reserve(size); shadowValid.resize(size);
+            shadowRay.resize(size); shadowValue.resize(size);
+            shadowPixel.resize(size);
+        }
+    };
+
+    void tracePaths(const Scene *scene, Sampler *sampler, PathPool &pool,
+                    const Ray3f *rays, Color3f *result, uint32_t count) const {
+        pool.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            pool.ray[i] = rays[i];
+            pool.throughput[i] = Color3f(1.0f);
+            pool.lastBsdfPdf[i] = 0.0f;
+            pool.lastSpecular[i] = true; // Start true to accept camera rays full weight
+            pool.pixel[i] = i;
+            result[i] = Color3f(0.0f);
+        }
+
+        uint32_t active = count;
+        for (int depth = 0; depth < 20 && active > 0; ++depth) {
+            // Extend: find the next vertex of all paths
+            for (uint32_t i = 0; i < active; i += NORI_PACKET_SIZE) {
+                uint32_t size = std::min((uint32_t) NORI_PACKET_SIZE, active - i);
+                uint64_t hits = scene->rayIntersect(&pool.ray[i], &pool.its[i], size);
+                for (uint32_t k = 0; k < size; ++k)
+                    pool.alive[i + k] = (hits >> k) & 1;
+            }
+
+            // Emitter hits, weighted against next event estimation
+            for (uint32_t i = 0; i < active; ++i) {
+                const Intersection &its = pool.its[i];
+                if (!pool.alive[i] || !its.isEmitter())
+                    continue;
+
+                EmitterQueryRecord lRec;
+                lRec.ref = pool.ray[i].o;
+                lRec.p = its.p;
+                lRec.n = its.shFrame.n;
+                lRec.wi = -pool.ray[i].d;
+                lRec.dist = its.t;
+                lRec.primIndex = its.primIndex;
+
+                Color3f Le = its.emitter->eval(lRec);
+                if (Le.isZero())
+                    continue;
+
+                float misWeight = 1.0f;
+                if (!pool.lastSpecular[i]) {
+                    float pdfLightArea = its.emitter->pdf(lRec);
+                    float G = std::abs(lRec.n.dot(lRec.wi)) / (lRec.dist * lRec.dist);
+                    float effectivePdfLight = pdfLightArea / G * scene->emitterPdf(lRec.ref, its.emitter);
+                    misWeight = pool.lastBsdfPdf[i] /
+                        (pool.lastBsdfPdf[i] + effectivePdfLight + 1e-5f);
+                }
+
+                result[pool.pixel[i]] += pool.throughput[i] * Le * misWeight;
+            }
+
+            // Shade the paths grouped by BSDF
+            pool.order.clear();
+            for (uint32_t i = 0; i < active; ++i) {
+                if (pool.alive[i] && pool.its[i].bsdf)
+                    pool.order.push_back(i);
+                else
+                    pool.alive[i] = false;
+            }
+            std::sort(pool.order.begin(), pool.order.end(),
+                [&](uint32_t a, uint32_t b) {
+                    const BSDF *bsdfA = pool.its[a].bsdf, *bsdfB = pool.its[b].bsdf;
+                    return bsdfA < bsdfB || (bsdfA == bsdfB && a < b);
+                });
+
+            for (uint32_t i = 0; i < active; ++i)
+                pool.shadowValid[i] = false;
+
+            for (uint32_t i : pool.order) {
+                const Intersection &its = pool.its[i];
+                const Ray3f &ray = pool.ray[i];
+                Color3f &throughput = pool.throughput[i];
+
+                // Next event estimation
+                if (scene->getEmitterCount() > 0) {
+                    float lightChoicePdf;
+                    const Emitter *emitter = scene->sampleEmitter(its.p, sampler->next1D(), lightChoicePdf);
+
+                    EmitterQueryRecord lRec;
+                    lRec.ref = its.p;
+                    float lightPdf = 0.0f; // Area Measure
+                    Color3f Le = emitter ? emitter->sample(lRec, sampler->next2D(), lightPdf)
+                                       : Color3f(0.0f);
+
+                    if (!Le.isZero() && lightPdf > 0.0f) {
+                        BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(lRec.wi), ESolidAngle);
+                        Color3f fr = its.bsdf->eval(bRec);
+
+                        if (!fr.isZero()) {
+                            float cosAtShading = Frame::cosTheta(bRec.wo);
+                            float cosAtLight   = std::abs(lRec.n.dot(-lRec.wi));
+                            float G            = cosAtLight / (lRec.dist * lRec.dist);
+                            float weightFactor = 1.0f / lightChoicePdf;
+
+                            float pdfBsdf = its.bsdf->pdf(bRec);
+                            float effectivePdfLight = lightPdf / G / weightFactor;
+                            float misWeight = effectivePdfLight / (effectivePdfLight + pdfBsdf + 1e-5f);
+
+                            // Deferred until the visibility of all connections is known
+                            pool.shadowValid[i] = true;
+                            pool.shadowRay[i] = Ray3f(its.p, lRec.wi, Epsilon, lRec.dist - Epsilon);
+                            pool.shadowValue[i] = throughput * fr * Le * cosAtShading * G
+                                * weightFactor / lightPdf * misWeight;
+                        }
+                    }
+                }
+
+                // Russian Roulette
+                if (depth >= 3) {
+                    float q = std::min(0.99f, throughput.maxCoeff());
+                    if (sampler->next1D() > q) {
+                        pool.alive[i] = false;
+                        continue;
+                    }
+                    throughput /= q;
+                }
+
+                // Indirect Illumination (BSDF Sampling)
+                BSDFQueryRecord bRec(its.toLocal(-ray.d));
+                Color3f bsdfWeight = its.bsdf->sample(bRec, sampler->next2D());
+                if (bsdfWeight.isZero()) {
+                    pool.alive[i] = false;
+                    continue;
+                }
+
+                pool.lastBsdfPdf[i] = its.bsdf->pdf(bRec);
+                pool.lastSpecular[i] = bRec.measure == EDiscrete;
+                throughput *= bsdfWeight;
+                pool.ray[i] = Ray3f(its.p, its.toWorld(bRec.wo), Epsilon, INFINITY);
+            }
+
+            // Connect: gather the shadow rays in path order (which keeps
+            // neighboring pixels together) and trace them as packets
+            uint32_t shadowCount = 0;
+            for (uint32_t i = 0; i < active; ++i) {
+                if (!pool.shadowValid[i])
+                    continue;
+                pool.shadowRay[shadowCount] = pool.shadowRay[i];
+                pool.shadowValue[shadowCount] = pool.shadowValue[i];
+                pool.shadowPixel[shadowCount] = pool.pixel[i];
+                ++shadowCount;
+            }
+
+            for (uint32_t i = 0; i < shadowCount; i += NORI_PACKET_SIZE) {
+                uint32_t size = std::min((uint32_t) NORI_PACKET_SIZE, shadowCount - i);
+                uint64_t occluded = scene->rayIntersect(&pool.shadowRay[i], size);
+                for (uint32_t k = 0; k < size; ++k) {
+                    if (!((occluded >> k) & 1))
+                        result[pool.shadowPixel[i + k]] += pool.shadowValue[i + k];
+                }
+            }
+
+            // Compact: move the surviving paths to the front of the pool
+            uint32_t alive = 0;
+            for (uint32_t i = 0; i < active; ++i) {
+                if (!pool.alive[i])
+                    continue;
+                if (alive != i) {
+                    pool.ray[alive] = pool.ray[i];
+                    pool.throughput[alive] = pool.throughput[i];
+                    pool.lastBsdfPdf[alive] = pool.lastBsdfPdf[i];
+                    pool.lastSpecular[alive] = pool.lastSpecular[i];
+                    pool.pixel[alive] = pool.pixel[i];
+                }
+                ++alive;
+            }
+            active = alive;
+        }
+    }
+
+private:
+    uint32_t m_poolSize;
+    mutable tbb::enumerable_thread_specific<PathPool> m_pools;
+};
+
+NORI_REGISTER_CLASS(PathWavefrontIntegrator, "path_wavefront");
+
+NORI_NAMESPACE_END
@@ -37,6 +37,15 @@ public:
         m_outputSize.y() = propList.getInteger("height", 720);
         m_invOutputSize = m_outputSize.cast<float>().cwiseInverse();
 
+        /* Optional crop window in pixels. Default: the entire image */
+        m_cropOffset.x() = propList.getInteger("cropX", 0);
+        m_cropOffset.y() = propList.getInteger("cropY", 0);
+        m_cropSize.x() = propList.getInteger("cropWidth", m_outputSize.x() - m_cropOffset.x());
+        m_cropSize.y() = propList.getInteger("cropHeight", m_outputSize.y() - m_cropOffset.y());
+        if ((m_cropOffset.array() < 0).any() || (m_cropSize.array() <= 0).any() ||
+            ((m_cropOffset + m_cropSize).array() > m_outputSize.array()).any())
+            throw NoriException("PerspectiveCamera: the crop window must lie within the image!");
+
         /* Specifies an optional camera-to-world transformation. Default: none */
         m_cameraToWorld = propList.getTransform("toWorld", Transform());
 
@@ -128,12 +137,15 @@ public:
             "PerspectiveCamera[\n"
             "  cameraToWorld = %s,\n"
             "  outputSize = %s,\n"
+            "  crop = %s + %s,\n"
             "  fov = %f,\n"
             "  clip = [%f, %f],\n"
             "  rfilter = %s\n"
             "]",
             indent(m_cameraToWorld.toString(), 18),
             m_outputSize.toString(),
+            m_cropOffset.toString(),
+            m_cropSize.toString(),
             m_fov,
             m_nearClip,
             m_farClip,
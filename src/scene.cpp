@@ -25,8 +25,17 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &props) {
+    m_accel = new Accel(props);
+
+    std::string lightSelection = props.getString("lightSelection", "power");
+    if (lightSelection == "power")
+        m_useLightBVH = false;
+    else if (lightSelection == "bvh")
+        m_useLightBVH = true;
+    else
+        throw NoriException("Scene: unsupported light selection \"%s\" (expected "
+            "\"power\" or \"bvh\")!", lightSelection);
 }
 
 Scene::~Scene() {
@@ -39,10 +48,46 @@ Scene::~Scene() {
 void Scene::activate() {
     m_accel->activate();
     m_shapes.push_back(m_accel);
+
+    /* Let instances find the prototypes they refer to */
+    for (Shape *shape : m_shapes)
+        shape->resolveReferences(m_prototypes);
+
     for( Shape *shape : m_shapes) {
         m_bbox.expandBy(shape->getBoundingBox());
     }
 
+    /* Build the top-level hierarchy over all shapes, and one over all but
+       the triangle BVH for the packet queries */
+    m_tlas.build(m_shapes);
+    m_packetTlas.build(std::vector<Shape *>(m_shapes.begin(), m_shapes.end() - 1));
+
+    /* Build the emitter table over the meshes and analytic shapes. Emitters
+       are chosen proportionally to their power, which is zero for lights
+       that don't emit anything */
+    m_lights.clear();
+    m_lightIndex.clear();
+    m_lightPDF.clear();
+    std::vector<float> lightPower;
+    auto addLight = [&](const Emitter *emitter) {
+        float power = emitter ? emitter->getPower().getLuminance() : 0.0f;
+        if (!(power > 0.0f))
+            return;
+        m_lightIndex[emitter] = (uint32_t) m_lights.size();
+        m_lights.push_back(emitter);
+        m_lightPDF.append(power);
+        lightPower.push_back(power);
+    };
+    for (uint32_t i = 0; i < m_accel->getMeshCount(); ++i)
+        addLight(m_accel->getMesh(i)->getEmitter());
+    for (Shape *shape : m_shapes)
+        addLight(shape->getEmitter());
+    m_lightPDF.normalize();
+
+    m_lightBVH.clear();
+    if (m_useLightBVH)
+        m_lightBVH.build(m_lights, lightPower);
+
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
@@ -59,6 +104,69 @@ void Scene::activate() {
     
 }
 
+const Emitter *Scene::sampleEmitter(const Point3f &ref, float sample, float &pdf) const {
+    pdf = 0.0f;
+    if (m_lights.empty())
+        return nullptr;
+
+    if (m_useLightBVH) {
+        int index = m_lightBVH.sample(ref, sample, pdf);
+        return index >= 0 ? m_lights[index] : nullptr;
+    }
+
+    return m_lights[m_lightPDF.sampleAlias(sample, pdf)];
+}
+
+float Scene::emitterPdf(const Point3f &ref, const Emitter *emitter) const {
+    auto it = m_lightIndex.find(emitter);
+    if (it == m_lightIndex.end())
+        return 0.0f;
+
+    if (m_useLightBVH)
+        return m_lightBVH.pdf(ref, it->second);
+
+    return m_lightPDF[it->second];
+}
+
+uint64_t Scene::rayIntersect(const Ray3f *rays, Intersection *its, uint32_t count) const {
+    for (uint32_t i = 0; i < count; ++i)
+        its[i].t = std::numeric_limits<float>::infinity();
+
+    /* Packet traversal is only supported by the triangle BVH. The other
+       shapes are intersected ray by ray, up to the closest triangle hit */
+    uint64_t hits = m_accel->rayIntersectPacket(rays, its, count);
+    if (m_shapes.size() == 1)
+        return hits;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t bit = 1ull << i;
+        Ray3f ray(rays[i]);
+        if (hits & bit)
+            ray.maxt = its[i].t;
+        if (m_packetTlas.rayIntersect(ray, its[i], false))
+            hits |= bit;
+    }
+    return hits;
+}
+
+uint64_t Scene::rayIntersect(const Ray3f *rays, uint32_t count) const {
+    uint64_t hits = m_accel->rayIntersectPacket(rays, nullptr, count, true);
+    if (m_shapes.size() == 1)
+        return hits;
+
+    /* Rays that aren't occluded by triangles may still be by other shapes */
+    Intersection its; /* Unused */
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t bit = 1ull << i;
+        if (hits & bit)
+            continue;
+        Ray3f ray(rays[i]);
+        if (m_packetTlas.rayIntersect(ray, its, true))
+            hits |= bit;
+    }
+    return hits;
+}
+
 void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
@@ -69,7 +177,13 @@ void Scene::addChild(NoriObject *obj) {
         
         case EShape: {
                 Shape *shape = static_cast<Shape *>(obj);
-                m_shapes.push_back(shape);
+                if (shape->isPrototype()) {
+                    if (!m_prototypes.insert({ shape->getId(), shape }).second)
+                        throw NoriException("There are multiple prototypes with "
+                            "the id \"%s\"!", shape->getId());
+                } else {
+                    m_shapes.push_back(shape);
+                }
             }
             break;
 
@@ -125,6 +239,8 @@ std::string Scene::toString() const {
         "  sampler = %s\n"
         "  camera = %s,\n"
         "  accel = %s,\n"
+        "  tlas = %s,\n"
+        "  lights = %s,\n"
         "  shapes = %s,\n"
         "  emitters = {\n"
         "  %s  }\n"
@@ -133,6 +249,9 @@ std::string Scene::toString() const {
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
         indent(m_accel->toString()),
+        m_tlas.toString(),
+        m_useLightBVH ? m_lightBVH.toString()
+                      : tfm::format("DiscretePDF[emitters=%i]", m_lights.size()),
         indent(shapes, 2),
         indent(emitters, 2)
     );
@@ -1,12 +1,28 @@
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
 #include <nori/shape.h>
+#include <nori/warp.h>
 #include <iostream>
 
 NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Analytic sphere
+ *
+ * Area lights attached to a sphere sample the cone of directions under
+ * which it is seen from the shading point, so that every sample lies on
+ * the visible cap.
+ */
 class Sphere : public Shape {
 public:
-  Sphere(const PropertyList &props) {}
+  Sphere(const PropertyList &props) {
+    m_center = props.getPoint("center", Point3f(0.f, 0.f, 0.f));
+    m_radius = props.getFloat("radius", 1.f);
+    if (!(m_radius > 0.f))
+      throw NoriException("Sphere: the radius must be positive!");
+    m_bbox = BoundingBox3f(m_center - Vector3f::Constant(m_radius),
+                           m_center + Vector3f::Constant(m_radius));
+  }
 
   void activate() {
     if (!m_bsdf) {
@@ -18,37 +34,90 @@ public:
 
   bool rayIntersect(Ray3f &ray, Intersection &its,
                     bool shadowRay = false) const {
-    // Parameters
-    Normal3f n(0, 1, 0); // Color
-    float radius = 1;    // Sphere radius
-
-    // Solution calculation
-    float denominator = 2 * ray.d.dot(ray.d);
-    float a = ray.d.dot(ray.d);
-    float b = 2*ray.o.dot(ray.d);
-    float c = ray.o.dot(ray.o) - radius*radius;
-    float delt2 = b*b - 4*a*c;
-    // Check if we have solution
-    if(delt2 < 0)
-    {
-        return false;
-    }
-    // Take the closest solution to the origin
-    float t1 = -b+std::sqrt(delt2);
-    float t2 = -b-std::sqrt(delt2);
+    Vector3f o = ray.o - m_center;
+    float a = ray.d.squaredNorm();
+    float b = 2.f * o.dot(ray.d);
+    float c = o.squaredNorm() - m_radius * m_radius;
+    float discrim = b * b - 4.f * a * c;
+    if (discrim < 0.f)
+      return false;
+
+    /* Numerically stable solution of the quadratic */
+    float q = -0.5f * (b + std::copysign(std::sqrt(discrim), b));
+    if (q == 0.f)
+      return false;
+    float t0 = q / a, t1 = c / q;
+    if (t0 > t1)
+      std::swap(t0, t1);
 
-    float numerator = (t1<t2) ? t1:t2;
-    if (denominator == 0.)
+    /* Take the closest solution within the ray segment */
+    float t = t0 >= ray.mint ? t0 : t1;
+    if (t < ray.mint || t > ray.maxt)
       return false;
-    float t = numerator / denominator;
-    if (t >= ray.mint and t <= ray.maxt) {
-      if (shadowRay) {
-        return true;
-      }
-      updateRayAndHit(ray, its, t, n);
+
+    if (shadowRay)
       return true;
+
+    updateRayAndHit(ray, its, t);
+    return true;
+  }
+
+  /// Bounds of the sphere
+  const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+  const Emitter *getEmitter() const { return m_emitter; }
+
+  float getSurfaceArea() const { return 4.f * M_PI * m_radius * m_radius; }
+
+  float sampleSurface(EmitterQueryRecord &lRec, const Point2f &sample) const {
+    Vector3f toCenter = m_center - lRec.ref;
+    float dist2 = toCenter.squaredNorm();
+
+    if (dist2 <= m_radius * m_radius) {
+      /* The reference point is inside: sample the whole surface */
+      lRec.n = Warp::squareToUniformSphere(sample);
+    } else {
+      /* Sample the cone of directions towards the visible cap. The
+         cosines are computed from sines to stay accurate for small cones */
+      float sin2ThetaMax = m_radius * m_radius / dist2;
+      float cosThetaMax = std::sqrt(std::max(0.f, 1.f - sin2ThetaMax));
+      float oneMinusCosThetaMax = sin2ThetaMax / (1.f + cosThetaMax);
+
+      float oneMinusCosTheta = sample.x() * oneMinusCosThetaMax;
+      float cosTheta = 1.f - oneMinusCosTheta;
+      float sin2Theta = oneMinusCosTheta * (2.f - oneMinusCosTheta);
+      float sinTheta = std::sqrt(std::max(0.f, sin2Theta));
+      float phi = 2.f * M_PI * sample.y();
+
+      float dist = std::sqrt(dist2);
+      Vector3f w = Frame(toCenter / dist).toWorld(Vector3f(
+          sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta));
+
+      /* Distance to the nearest intersection along the sampled direction */
+      float t = dist * cosTheta -
+                std::sqrt(std::max(0.f, m_radius * m_radius - dist2 * sin2Theta));
+      lRec.n = (lRec.ref + t * w - m_center).normalized();
     }
-    return false;
+
+    lRec.p = m_center + m_radius * lRec.n;
+    Vector3f d = lRec.p - lRec.ref;
+    lRec.dist = d.norm();
+    lRec.wi = d / lRec.dist;
+
+    return pdfSurface(lRec);
+  }
+
+  float pdfSurface(const EmitterQueryRecord &lRec) const {
+    float dist2 = (m_center - lRec.ref).squaredNorm();
+    if (dist2 <= m_radius * m_radius)
+      return 1.f / getSurfaceArea();
+
+    /* Uniform density over the cone, converted to surface area */
+    float sin2ThetaMax = m_radius * m_radius / dist2;
+    float cosThetaMax = std::sqrt(std::max(0.f, 1.f - sin2ThetaMax));
+    float oneMinusCosThetaMax = sin2ThetaMax / (1.f + cosThetaMax);
+    float pdfSolidAngle = 1.f / (2.f * M_PI * oneMinusCosThetaMax);
+    return pdfSolidAngle * std::abs(lRec.n.dot(lRec.wi)) / (lRec.dist * lRec.dist);
   }
 
   /// Register a child object (e.g. a BSDF) with the mesh
@@ -78,25 +147,37 @@ public:
   std::string toString() const {
     return tfm::format(
         "Sphere[\n"
+        "center = %s\n"
+        "radius = %f\n"
         "emitter = %s\n"
         "bsdf = %s\n"
         "]",
+        m_center.toString(), m_radius,
         (m_emitter) ? indent(m_emitter->toString()) : std::string("null"),
         (m_bsdf) ? indent(m_bsdf->toString()) : std::string("null"));
   }
 
 private:
-  void updateRayAndHit(Ray3f &ray, Intersection &its, float t,
-                       const Normal3f &n) const {
+  void updateRayAndHit(Ray3f &ray, Intersection &its, float t) const {
     ray.maxt = its.t = t;
-    its.p = ray(its.t);
-    its.uv = Point2f(its.p.x(), its.p.z());
+
+    /* Project the hit point onto the surface to reduce its error */
+    Normal3f n = (ray(t) - m_center).normalized();
+    its.p = m_center + m_radius * n;
+
+    /* Spherical coordinates */
+    float u = std::atan2(n.y(), n.x()) * (0.5f * INV_PI);
+    its.uv = Point2f(u < 0.f ? u + 1.f : u,
+                     std::acos(clamp(n.z(), -1.f, 1.f)) * INV_PI);
     its.bsdf = m_bsdf;
     its.emitter = m_emitter;
     its.geoFrame = its.shFrame = Frame(n);
   }
 
 private:
+  Point3f m_center;
+  float m_radius;
+  BoundingBox3f m_bbox;
   BSDF *m_bsdf = nullptr;       ///< BSDF of the surface
   Emitter *m_emitter = nullptr; ///< Associated emitter, if any
 };
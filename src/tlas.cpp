@@ -0,0 +1,177 @@
+#include <nori/tlas.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/* Cost model of the SAH, relative to the cost of a shape intersection */
+static const float TLAS_TRAVERSAL_COST = 1.0f;
+static const float TLAS_INTERSECTION_COST = 1.0f;
+
+void TopLevelAccel::build(const std::vector<Shape *> &shapes) {
+    clear();
+
+    for (Shape *shape : shapes) {
+        const BoundingBox3f &bbox = shape->getBoundingBox();
+        if (bbox.isValid()) {
+            m_shapes.push_back(shape);
+            m_bbox.expandBy(bbox);
+        } else {
+            m_unbounded.push_back(shape);
+        }
+    }
+
+    if (m_shapes.empty())
+        return;
+
+    /* A binary tree over n shapes has at most 2n-1 nodes */
+    m_nodes.reserve(2 * m_shapes.size() - 1);
+    m_nodes.emplace_back();
+    buildRecursive(0, 0, (uint32_t) m_shapes.size(), 0);
+}
+
+void TopLevelAccel::clear() {
+    m_shapes.clear();
+    m_unbounded.clear();
+    m_nodes.clear();
+    m_bbox.reset();
+}
+
+void TopLevelAccel::buildRecursive(uint32_t nodeIdx, uint32_t start, uint32_t end,
+                                   uint32_t depth) {
+    uint32_t size = end - start;
+
+    BoundingBox3f bbox;
+    for (uint32_t i = start; i < end; ++i)
+        bbox.expandBy(m_shapes[i]->getBoundingBox());
+    m_nodes[nodeIdx].bbox = bbox;
+
+    /* Sweep over all split positions along the three axes */
+    float bestCost = TLAS_INTERSECTION_COST * size;
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+    std::vector<float> rightArea(size);
+
+    auto centroidLess = [](int axis) {
+        return [axis](const Shape *s1, const Shape *s2) {
+            return s1->getBoundingBox().getCenter()[axis] <
+                   s2->getBoundingBox().getCenter()[axis];
+        };
+    };
+
+    if (size > 1 && depth < MaxDepth) {
+        float invArea = 1.0f / bbox.getSurfaceArea();
+        for (int axis = 0; axis < 3; ++axis) {
+            std::sort(m_shapes.begin() + start, m_shapes.begin() + end, centroidLess(axis));
+
+            BoundingBox3f right;
+            for (uint32_t i = size - 1; i > 0; --i) {
+                right.expandBy(m_shapes[start + i]->getBoundingBox());
+                rightArea[i] = right.getSurfaceArea();
+            }
+
+            BoundingBox3f left;
+            for (uint32_t i = 1; i < size; ++i) {
+                left.expandBy(m_shapes[start + i - 1]->getBoundingBox());
+                float cost = 2.0f * TLAS_TRAVERSAL_COST + TLAS_INTERSECTION_COST * invArea *
+                    (i * left.getSurfaceArea() + (size - i) * rightArea[i]);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        m_nodes[nodeIdx].start = start;
+        m_nodes[nodeIdx].size = size;
+        return;
+    }
+
+    std::sort(m_shapes.begin() + start, m_shapes.begin() + end, centroidLess(bestAxis));
+
+    uint32_t left = (uint32_t) m_nodes.size();
+    m_nodes[nodeIdx].start = left;
+    m_nodes[nodeIdx].size = 0;
+    m_nodes.emplace_back();
+    m_nodes.emplace_back();
+
+    buildRecursive(left, start, start + bestSplit, depth + 1);
+    buildRecursive(left + 1, start + bestSplit, end, depth + 1);
+}
+
+bool TopLevelAccel::rayIntersect(Ray3f &ray, Intersection &its, bool shadowRay) const {
+    bool foundIntersection = false;
+
+    for (const Shape *shape : m_unbounded) {
+        if (shape->rayIntersect(ray, its, shadowRay)) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+        }
+    }
+
+    if (m_nodes.empty())
+        return foundIntersection;
+
+    /* Nodes to be visited along with their entry distance */
+    std::pair<uint32_t, float> stack[MaxDepth + 1];
+    uint32_t stackIdx = 0;
+
+    float nearT, farT;
+    if (!m_nodes[0].bbox.rayIntersect(ray, nearT, farT) ||
+        farT < ray.mint || nearT > ray.maxt)
+        return foundIntersection;
+    stack[stackIdx++] = std::make_pair(0u, nearT);
+
+    while (stackIdx > 0) {
+        std::pair<uint32_t, float> entry = stack[--stackIdx];
+
+        /* Skip nodes beyond an intersection found in the meantime */
+        if (entry.second > ray.maxt)
+            continue;
+
+        const Node &node = m_nodes[entry.first];
+        if (node.isLeaf()) {
+            for (uint32_t i = node.start; i < node.start + node.size; ++i) {
+                if (m_shapes[i]->rayIntersect(ray, its, shadowRay)) {
+                    if (shadowRay)
+                        return true;
+                    foundIntersection = true;
+                }
+            }
+            continue;
+        }
+
+        float nearT0, farT0, nearT1, farT1;
+        bool hit0 = m_nodes[node.start].bbox.rayIntersect(ray, nearT0, farT0) &&
+                    farT0 >= ray.mint && nearT0 <= ray.maxt;
+        bool hit1 = m_nodes[node.start + 1].bbox.rayIntersect(ray, nearT1, farT1) &&
+                    farT1 >= ray.mint && nearT1 <= ray.maxt;
+
+        /* Push far-to-near, so that the nearest child is visited first */
+        if (hit0 && hit1) {
+            if (nearT0 <= nearT1) {
+                stack[stackIdx++] = std::make_pair(node.start + 1, nearT1);
+                stack[stackIdx++] = std::make_pair(node.start, nearT0);
+            } else {
+                stack[stackIdx++] = std::make_pair(node.start, nearT0);
+                stack[stackIdx++] = std::make_pair(node.start + 1, nearT1);
+            }
+        } else if (hit0) {
+            stack[stackIdx++] = std::make_pair(node.start, nearT0);
+        } else if (hit1) {
+            stack[stackIdx++] = std::make_pair(node.start + 1, nearT1);
+        }
+    }
+
+    return foundIntersection;
+}
+
+std::string TopLevelAccel::toString() const {
+    return tfm::format("TopLevelAccel[shapes=%i, unbounded=%i, nodes=%i]",
+        m_shapes.size(), m_unbounded.size(), m_nodes.size());
+}
+
+NORI_NAMESPACE_END